@@ -0,0 +1,241 @@
+/******************************
+ * 入力処理の確認 (make check)
+ *
+ * main.c を取り込み、ハンドラを直接呼び出す。
+ * malloc/realloc/calloc はリンク時に --wrap で置き換える。
+ ******************************/
+
+#define main _app_main
+#include "main.c"
+#undef main
+
+//回数
+#define CHECK_ALLOC_WARMUP  100
+#define CHECK_ALLOC_ROUNDS  1000
+
+
+//-----------------------
+// ヒープ確保の回数
+//-----------------------
+
+
+/* g_alloc_counting が 0 の間は数えない。
+ * 確認はメインスレッドのみで行う。 */
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr,size_t size);
+void *__real_calloc(size_t num,size_t size);
+
+int g_alloc_counting = 0,
+	g_alloc_cnt = 0;
+
+void *__wrap_malloc(size_t size)
+{
+	if(g_alloc_counting) g_alloc_cnt++;
+
+	return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr,size_t size)
+{
+	if(g_alloc_counting) g_alloc_cnt++;
+
+	return __real_realloc(ptr, size);
+}
+
+void *__wrap_calloc(size_t num,size_t size)
+{
+	if(g_alloc_counting) g_alloc_cnt++;
+
+	return __real_calloc(num, size);
+}
+
+
+//-----------------------
+// 入力処理のヒープ確保
+//-----------------------
+
+
+/* 1回分の入力
+ *
+ * 変換中の preedit、確定、削除の順に done を送る。
+ * テキストの長さは元に戻るので、TextBuf は拡張されない。 */
+
+static void _check_alloc_round(InputSeat *st)
+{
+	_input_preedit_string(st, NULL, "\xe3\x81\x82", 3, 3);
+	_input_done(st, NULL, 0);
+
+	_input_preedit_string(st, NULL, "\xe3\x81\x82\xe3\x81\x84", 6, 6);
+	_input_done(st, NULL, 0);
+
+	_input_commit_string(st, NULL, "\xe6\x84\x9b");
+	_input_done(st, NULL, 0);
+
+	_input_delete_surrounding_text(st, NULL, 3, 0);
+	_input_done(st, NULL, 0);
+}
+
+/* 入力のハンドラで、ヒープ確保が行われないか確認
+ *
+ * ウォームアップ後に確保された回数が 0 でなければ失敗。
+ * アンドゥ履歴は、ウォームアップ中に上限に達するように小さくする。
+ *
+ * return: 0 で成功 */
+
+static int _check_alloc(void)
+{
+	InputSeat *st;
+	int i,ret = 1;
+
+	g_text = TextBuf_new(0);
+	g_undo = TextUndo_new(4096);
+
+	st = (InputSeat *)calloc(1, sizeof(InputSeat));
+	g_redraw_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if(!g_text || !g_undo || !st || g_redraw_fd < 0) goto END;
+
+	st->pending.arena = MemArena_new(0);
+	st->preedit_cursor = -1;
+
+	if(!st->pending.arena) goto END;
+
+	//ウォームアップ後に数える
+
+	for(i = 0; i < CHECK_ALLOC_WARMUP + CHECK_ALLOC_ROUNDS; i++)
+	{
+		if(i == CHECK_ALLOC_WARMUP)
+		{
+			g_alloc_cnt = 0;
+			g_alloc_counting = 1;
+		}
+
+		_check_alloc_round(st);
+	}
+
+	g_alloc_counting = 0;
+
+	printf("check-alloc: %d allocations in %d rounds (arena blocks:%d)\n",
+		g_alloc_cnt, CHECK_ALLOC_ROUNDS, st->pending.arena->block_cnt);
+
+	ret = (g_alloc_cnt != 0);
+
+END:
+	if(st)
+	{
+		_seat_destroy_text_input(st);
+		free(st);
+	}
+
+	if(g_redraw_fd >= 0)
+	{
+		close(g_redraw_fd);
+		g_redraw_fd = -1;
+	}
+
+	TextBuf_destroy(g_text);
+	TextUndo_destroy(g_undo);
+
+	g_text = NULL;
+	g_undo = NULL;
+
+	return ret;
+}
+
+
+//-----------------------
+// アンドゥ履歴の上限
+//-----------------------
+
+
+/* テキストが text と同じか */
+
+static int _text_equal(TextBuf *tb,const char *text,int len)
+{
+	int i;
+
+	if(TextBuf_getLength(tb) != len) return 0;
+
+	for(i = 0; i < len; i++)
+	{
+		if(TextBuf_getChar(tb, i) != (uint8_t)text[i]) return 0;
+	}
+
+	return 1;
+}
+
+/* 記録中の単位が上限を超えた場合
+ *
+ * "HELLO" の後、貼り付けのように 64 バイトずつ 8 回挿入する (上限 256 バイト)。
+ * アンドゥで、存在しなかったテキストにならないか確認。
+ *
+ * return: 0 で成功 */
+
+static int _check_undo_cap(void)
+{
+	TextBuf *tb;
+	TextUndo *undo;
+	char full[5 + 64 * 8];
+	int i,ret = 1;
+
+	tb = TextBuf_new(0);
+	undo = TextUndo_new(256);
+
+	if(!tb || !undo) goto END;
+
+	memcpy(full, "HELLO", 5);
+	memset(full + 5, 'x', 64 * 8);
+
+	TextUndo_insert(undo, tb, full, 5);
+	TextUndo_begin(undo);
+
+	for(i = 0; i < 8; i++)
+	{
+		TextBuf_insert(tb, full + 5, 64);
+		TextUndo_addInserted(undo, tb, 64);
+	}
+
+	//アンドゥするごとに、いずれかの状態であること
+
+	for(i = 0; i < 4; i++)
+	{
+		if(!_text_equal(tb, full, 0)
+			&& !_text_equal(tb, full, 5)
+			&& !_text_equal(tb, full, sizeof(full)))
+		{
+			printf("check-undo-cap: undo %d left %d bytes\n", i, TextBuf_getLength(tb));
+			goto END;
+		}
+
+		if(TextUndo_undo(undo, tb)) break;
+	}
+
+	printf("check-undo-cap: %d bytes after %d undo\n", TextBuf_getLength(tb), i);
+
+	ret = 0;
+
+END:
+	TextBuf_destroy(tb);
+	TextUndo_destroy(undo);
+
+	return ret;
+}
+
+
+//---------------
+
+
+/* 失敗した確認があれば 1 で終了 */
+
+int main(int argc,char **argv)
+{
+	int ret = 0;
+
+	if(_check_alloc()) ret = 1;
+	if(_check_undo_cap()) ret = 1;
+
+	printf("check: %s\n", (ret)? "FAILED": "ok");
+
+	return ret;
+}
@@ -10,12 +10,35 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <linux/sockios.h>
 
 #include <wayland-client.h>
+#include <wayland-cursor.h>
+
+#include "viewporter-client-protocol.h"
+#include "fractional-scale-v1-client-protocol.h"
 
 #include "client.h"
 #include "imagebuf.h"
 
+/* wl_surface.preferred_buffer_scale (ver 6) に対応したヘッダなら ver 6 までバインド */
+
+#ifdef WL_SURFACE_PREFERRED_BUFFER_SCALE_SINCE_VERSION
+#define CLIENT_COMPOSITOR_VERSION  6
+#else
+#define CLIENT_COMPOSITOR_VERSION  4
+#endif
+
+static void _window_update_scale(Window *p);
+static void _window_create_surface(Window *p);
+static void _window_release_surface(Window *p);
+
 
 //========================
 // 破棄
@@ -24,21 +47,22 @@
 
 /* wl_pointer 破棄 */
 
-static void _pointer_release(Client *p)
+static void _pointer_release(Seat *p)
 {
-	if(p->seat_ver >= WL_POINTER_RELEASE_SINCE_VERSION)
+	if(p->ver >= WL_POINTER_RELEASE_SINCE_VERSION)
 		wl_pointer_release(p->pointer);
 	else
 		wl_pointer_destroy(p->pointer);
 
 	p->pointer = NULL;
+	p->cursor = NULL;	//アニメーションも止まる
 }
 
 /* wl_keyboard 破棄 */
 
-static void _keyboard_release(Client *p)
+static void _keyboard_release(Seat *p)
 {
-	if(p->seat_ver >= WL_KEYBOARD_RELEASE_SINCE_VERSION)
+	if(p->ver >= WL_KEYBOARD_RELEASE_SINCE_VERSION)
 		wl_keyboard_release(p->keyboard);
 	else
 		wl_keyboard_destroy(p->keyboard);
@@ -102,381 +126,2228 @@ static void _shell_surface_popup_done(void *data,struct wl_shell_surface *shell_
 
 }
 
+/* xdg_surface.configure
+ *
+ * configure は連続して届くことがあるので、ここでは記録だけして、
+ * 次の更新時に最後のものだけを適用・応答する。 */
+
 static void _xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
 {
-    xdg_surface_ack_configure(xdg_surface, serial);
+	Window *p = (Window *)data;
+
+	p->configure_serial = serial;
+	p->configure_pending = 1;
+
+	//最初の configure で、保留していた更新を行う
+
+	if(!p->configured)
+	{
+		p->configured = 1;
+
+		/* サイズかスケールが変わる場合は、事前に描画した内容は使えないので
+		 * Client_redraw() で描画し直す */
+
+		if((p->configure_width > 0 && p->configure_width != p->width)
+			|| (p->configure_height > 0 && p->configure_height != p->height)
+			|| p->scale_changed)
+		{
+			if(p->pending_update == WINDOW_UPDATE_OPAQUE)
+				p->opaque = 1;
+
+			Window_setDirty(p);
+		}
+		else if(p->pending_update == WINDOW_UPDATE_OPAQUE)
+			Window_updateOpaque(p);
+		else if(p->pending_update == WINDOW_UPDATE_ALPHA)
+			Window_update(p);
+		else
+			Window_setDirty(p);
+
+		p->pending_update = WINDOW_UPDATE_NONE;
+	}
+	else
+		Window_setDirty(p);
 }
 
 static const struct xdg_surface_listener g_xdg_surface_listener = {
     .configure = _xdg_surface_configure,
 };
 
+//========================
+// xdg_toplevel
+//========================
+
+
+static void _xdg_toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+	int32_t width, int32_t height, struct wl_array *states)
+{
+	Window *p = (Window *)data;
+
+	p->configure_width = width;
+	p->configure_height = height;
+}
+
+static void _xdg_toplevel_close(void *data, struct xdg_toplevel *toplevel)
+{
+	Window *p = (Window *)data;
+
+	if(p->close)
+		(p->close)(p);
+	else
+		p->client->finish_loop = 1;
+}
+
+static const struct xdg_toplevel_listener g_xdg_toplevel_listener = {
+	.configure = _xdg_toplevel_configure,
+	.close = _xdg_toplevel_close,
+};
+
 
 //========================
-// wl_seat
+// wl_surface (Window)
 //========================
 
 
-static void _seat_capabilities(void *data,struct wl_seat *seat,uint32_t cap)
+/* 表示される wl_output に入った */
+
+static void _surface_enter(void *data,struct wl_surface *surface,struct wl_output *output)
 {
-	Client *p = (Client *)data;
+	Window *p = (Window *)data;
 
-	//wl_pointer
+	if(p->enter_output_num < WINDOW_OUTPUT_MAX)
+	{
+		p->enter_outputs[p->enter_output_num++] = output;
 
-	if(p->init_flags & INIT_FLAGS_POINTER)
+		_window_update_scale(p);
+	}
+}
+
+static void _window_leave_output(Window *p,struct wl_output *output)
+{
+	int i;
+
+	for(i = 0; i < p->enter_output_num; i++)
 	{
-		if((cap & WL_SEAT_CAPABILITY_POINTER) && !p->pointer)
+		if(p->enter_outputs[i] == output)
 		{
-			p->pointer = wl_seat_get_pointer(seat);
+			p->enter_outputs[i] = p->enter_outputs[--p->enter_output_num];
 
-			wl_pointer_add_listener(p->pointer, p->pointer_listener, p);
+			_window_update_scale(p);
+			break;
 		}
-		else if(!(cap & WL_SEAT_CAPABILITY_POINTER) && p->pointer)
-			_pointer_release(p);
 	}
+}
 
-	//wl_keyboard
+static void _surface_leave(void *data,struct wl_surface *surface,struct wl_output *output)
+{
+	_window_leave_output((Window *)data, output);
+}
 
-	if(p->init_flags & INIT_FLAGS_KEYBOARD)
+#ifdef WL_SURFACE_PREFERRED_BUFFER_SCALE_SINCE_VERSION
+
+static void _surface_preferred_buffer_scale(void *data,struct wl_surface *surface,int32_t factor)
+{
+	Window *p = (Window *)data;
+
+	//wp_fractional_scale_v1 を優先
+
+	if(!p->fractional_scale)
 	{
-		if((cap & WL_SEAT_CAPABILITY_KEYBOARD) && !p->keyboard)
-		{
-			p->keyboard = wl_seat_get_keyboard(seat);
+		p->preferred_scale120 = factor * 120;
 
-			wl_keyboard_add_listener(p->keyboard, p->keyboard_listener, p);
-		}
-		else if(!(cap & WL_SEAT_CAPABILITY_KEYBOARD) && p->keyboard)
-			_keyboard_release(p);
+		_window_update_scale(p);
 	}
-	
-	//ほか
+}
 
-	if(p->seat_capabilities)
-		(p->seat_capabilities)(p, seat, cap);
+static void _surface_preferred_buffer_transform(void *data,struct wl_surface *surface,uint32_t transform)
+{
 }
 
-static void _seat_name(void *data,struct wl_seat *wl_seat,const char *name)
+#endif
+
+static const struct wl_surface_listener g_surface_listener = {
+	.enter = _surface_enter,
+	.leave = _surface_leave,
+#ifdef WL_SURFACE_PREFERRED_BUFFER_SCALE_SINCE_VERSION
+	.preferred_buffer_scale = _surface_preferred_buffer_scale,
+	.preferred_buffer_transform = _surface_preferred_buffer_transform,
+#endif
+};
+
+/* wp_fractional_scale_v1 */
+
+static void _fractional_preferred_scale(void *data,
+	struct wp_fractional_scale_v1 *fractional,uint32_t scale)
 {
+	Window *p = (Window *)data;
 
+	p->preferred_scale120 = scale;
+
+	_window_update_scale(p);
 }
 
-static const struct wl_seat_listener g_seat_listener = {
-	_seat_capabilities, _seat_name
+static const struct wp_fractional_scale_v1_listener g_fractional_scale_listener = {
+	_fractional_preferred_scale
 };
 
 
 //========================
-// wl_registry
+// wl_output
 //========================
 
 
-static void _registry_global(
-	void *data,struct wl_registry *reg,uint32_t id,const char *name,uint32_t ver)
+static void _output_geometry(void *data,struct wl_output *output,
+	int32_t x,int32_t y,int32_t pw,int32_t ph,int32_t subpixel,
+	const char *make,const char *model,int32_t transform)
 {
-    fprintf(stderr, "_registry_global\n");
-	Client *p = (Client *)data;
+}
 
-    if(strcmp(name, "wl_compositor") == 0) {
-		p->compositor = wl_registry_bind(reg, id, &wl_compositor_interface, 1);
-    } else if (strcmp(name, "wl_shm") == 0) {
-		p->shm = wl_registry_bind(reg, id, &wl_shm_interface, 1);
-
-    } else if(strcmp(name, "xdg_wm_base") == 0) {
-        p->wm_base = wl_registry_bind(reg, id, &xdg_wm_base_interface, 1);
-        fprintf(stderr, "wm_base registered!\n");
-        xdg_wm_base_add_listener(p->wm_base, &xdg_wm_base_listener, NULL);
-    } else if((p->init_flags & INIT_FLAGS_SEAT)
-        && strcmp(name, "wl_seat") == 0) {
-		/* Client::registry_global で wl_seat を処理する場合もあるので
-		 * フラグが ON の時のみ処理 */
-
-		if(ver >= 5) ver = 5;
-		
-		p->seat = wl_registry_bind(reg, id, &wl_seat_interface, ver);
-		p->seat_ver = ver;
+static void _output_mode(void *data,struct wl_output *output,
+	uint32_t flags,int32_t w,int32_t h,int32_t refresh)
+{
+}
+
+/* 変更を確定して、その wl_output 上のウィンドウのスケールを更新 */
 
-		wl_seat_add_listener(p->seat, &g_seat_listener, p);
+static void _output_done(void *data,struct wl_output *output)
+{
+	Output *p = (Output *)data;
+	Client *cl;
+	Window *win;
+	int i,j;
 
-		//引き続き、ハンドラ内で wl_pointer などを作成したいので、同期させる
+	if(p->scale == p->scale_pending) return;
 
-		Client_add_init_sync(p);
-    } else if(p->registry_global) {
-		(p->registry_global)(data, reg, id, name, ver);
-    }
+	p->scale = p->scale_pending;
+
+	cl = (Client *)p->client;
+
+	for(i = 0; i < cl->window_num; i++)
+	{
+		win = cl->windows[i];
+
+		for(j = 0; j < win->enter_output_num; j++)
+		{
+			if(win->enter_outputs[j] == output)
+			{
+				_window_update_scale(win);
+				break;
+			}
+		}
+	}
 }
 
-static void _registry_global_remove(void *data,struct wl_registry *registry,uint32_t id)
+static void _output_scale(void *data,struct wl_output *output,int32_t factor)
 {
+	((Output *)data)->scale_pending = factor;
 }
 
-static const struct wl_registry_listener g_registry_listener = {
-    .global = _registry_global,
-    .global_remove = _registry_global_remove,
+static const struct wl_output_listener g_output_listener = {
+	.geometry = _output_geometry,
+	.mode = _output_mode,
+	.done = _output_done,
+	.scale = _output_scale,
 };
 
 
 //========================
-// Client
+// wl_seat
 //========================
 
 
-/* クライアント終了 */
-
-void Client_destroy(Client *p)
+static void _seat_capabilities(void *data,struct wl_seat *seat,uint32_t cap)
 {
-	if(p)
-	{
-		//破棄ハンドラ
-	
-		if(p->destroy)
-			(p->destroy)(p);
-	
-		//poll
+	Seat *st = (Seat *)data;
+	Client *p = st->client;
 
-		Client_poll_clear(p);
-	
-		//wl_seat
+	//wl_pointer
 
-		if(p->pointer)
-			_pointer_release(p);
-		
-		if(p->seat)
+	if(p->init_flags & INIT_FLAGS_POINTER)
+	{
+		if((cap & WL_SEAT_CAPABILITY_POINTER) && !st->pointer)
 		{
-			if(p->seat_ver >= WL_SEAT_RELEASE_SINCE_VERSION)
-				wl_seat_release(p->seat);
-			else
-				wl_seat_destroy(p->seat);
+			st->pointer = wl_seat_get_pointer(seat);
+
+			wl_pointer_add_listener(st->pointer, p->pointer_listener, st);
 		}
+		else if(!(cap & WL_SEAT_CAPABILITY_POINTER) && st->pointer)
+			_pointer_release(st);
+	}
 
-		//
-	
-		wl_shm_destroy(p->shm);
-//		wl_shell_destroy(p->shell);
-        xdg_wm_base_destroy(p->wm_base);
-		wl_compositor_destroy(p->compositor);
+	//wl_keyboard
 
-		wl_registry_destroy(p->registry);
-	
-		wl_display_disconnect(p->display);
+	if(p->init_flags & INIT_FLAGS_KEYBOARD)
+	{
+		if((cap & WL_SEAT_CAPABILITY_KEYBOARD) && !st->keyboard)
+		{
+			st->keyboard = wl_seat_get_keyboard(seat);
 
-		free(p);
+			wl_keyboard_add_listener(st->keyboard, p->keyboard_listener, st);
+		}
+		else if(!(cap & WL_SEAT_CAPABILITY_KEYBOARD) && st->keyboard)
+			_keyboard_release(st);
 	}
-}
+	
+	//ほか
 
-/* Client データ確保
- *
- * size: 構造体のサイズ。sizeof(Client) 以下なら自動で最低サイズ。 */
+	if(p->seat_capabilities)
+		(p->seat_capabilities)(p, st, cap);
+}
 
-Client *Client_new(int size)
+static void _seat_name(void *data,struct wl_seat *wl_seat,const char *name)
 {
-	Client *p;
 
-	if(size < sizeof(Client))
-		size = sizeof(Client);
+}
 
-	p = (Client *)calloc(1, size);
-	if(!p) return NULL;
+static const struct wl_seat_listener g_seat_listener = {
+	_seat_capabilities, _seat_name
+};
 
-	wl_list_init(&p->list_poll);
 
-	return p;
-}
+//========================
+// カーソル
+//========================
 
-/* Wayland クライアントの初期化 */
 
-void Client_init(Client *p)
+/* スケールのカーソルテーマを取得
+ *
+ * 初めて使うスケールの時に読み込む。
+ * 上限まで読み込んでいる場合や、読み込めなかった場合は、最も近いスケールのものを使う。
+ * return: NULL でなし */
+
+static ClientCursorTheme *_cursor_get_theme(Client *p,int scale)
 {
-	struct wl_display *disp;
+	ClientCursorTheme *ct,*near = NULL;
+	const char *name,*env;
+	int i;
 
-	//接続
+	for(i = 0; i < p->cursor_theme_num; i++)
+	{
+		ct = p->cursor_themes + i;
+
+		if(ct->scale == scale) return ct;
+
+		if(!near || abs(ct->scale - scale) < abs(near->scale - scale))
+			near = ct;
+	}
+
+	if(p->cursor_theme_num == CLIENT_CURSOR_THEME_MAX || !p->shm)
+		return near;
 
-	disp = p->display = wl_display_connect(NULL);
+	//サイズとテーマ名
 
-	if(!disp)
+	if(p->cursor_size <= 0)
 	{
-		printf("failed wl_display_connect\n");
-		exit(1);
+		env = getenv("XCURSOR_SIZE");
+
+		p->cursor_size = (env)? atoi(env): 0;
+		if(p->cursor_size <= 0) p->cursor_size = 24;
 	}
 
-	//wl_registry
+	name = (p->cursor_theme)? p->cursor_theme: getenv("XCURSOR_THEME");
 
-	p->registry = wl_display_get_registry(disp);
+	//読み込み
 
-	wl_registry_add_listener(p->registry, &g_registry_listener, p);
+	ct = p->cursor_themes + p->cursor_theme_num;
 
-	Client_add_init_sync(p);
+	ct->theme = wl_cursor_theme_load(name, p->cursor_size * scale, p->shm);
+	if(!ct->theme) return near;
 
-	//初期処理が終わるまで待つ
+	ct->scale = scale;
+	p->cursor_theme_num++;
 
-	while(wl_display_dispatch(disp) != -1 && p->disp_sync_cnt);
+	return ct;
 }
 
-/* 初期化時の同期要求を追加
+/* カーソルのフレームを表示
  *
- * 待つ必要があれば、バインドしてハンドラを設定した回数分実行する */
+ * wl_buffer はテーマ内で作成済みのものを使うので、イメージの転送はない。
+ * ホットスポットが変わった時のみ wl_pointer.set_cursor を送る。 */
 
-void Client_add_init_sync(Client *p)
+static void _cursor_show_frame(Seat *st,int frame)
 {
-	struct wl_callback *callback;
+	Client *p = st->client;
+	struct wl_cursor_image *img;
+	struct wl_buffer *buffer;
+	int hx,hy;
 
-	callback = wl_display_sync(p->display);
+	img = st->cursor->images[frame];
 
-	wl_callback_add_listener(callback, &g_display_sync_listener, p);
+	buffer = wl_cursor_image_get_buffer(img);
+	if(!buffer) return;
 
-	p->disp_sync_cnt++;
-}
+	st->cursor_frame = frame;
 
-/* イベントループ (単純) */
+	wl_surface_attach(st->cursor_surface, buffer, 0, 0);
 
-void Client_loop_simple(Client *p)
-{
-	while(wl_display_dispatch(p->display) != -1 && p->finish_loop == 0);
-}
+	if(p->compositor_ver >= WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION)
+		wl_surface_set_buffer_scale(st->cursor_surface, st->cursor_scale);
 
-/* イベントループ (poll) */
+	if(p->compositor_ver >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+		wl_surface_damage_buffer(st->cursor_surface, 0, 0, img->width, img->height);
+	else
+		wl_surface_damage(st->cursor_surface, 0, 0, img->width, img->height);
 
-void Client_loop_poll(Client *p)
-{
-	struct pollfd fds[10];
-	int i,num;
-	PollItem *pi,*ptr[10];
+	wl_surface_commit(st->cursor_surface);
 
-	//fds[0] は Wayland イベント用
+	//ホットスポットはサーフェスの座標
 
-	fds[0].fd = wl_display_get_fd(p->display);
-	fds[0].events = POLLIN;
+	hx = img->hotspot_x / st->cursor_scale;
+	hy = img->hotspot_y / st->cursor_scale;
 
-	//
+	if(hx != st->cursor_hot_x || hy != st->cursor_hot_y)
+	{
+		wl_pointer_set_cursor(st->pointer, st->cursor_serial, st->cursor_surface, hx, hy);
 
-	while(!p->finish_loop)
+		st->cursor_hot_x = hx;
+		st->cursor_hot_y = hy;
+	}
+}
+
+/* アニメーションを進めて、タイマーをセットし直す
+ *
+ * 全 seat のカーソルで、次にフレームが切り替わるまでの最短の時間をセットする。
+ * アニメーションするカーソルがなければ止める。 */
+
+static void _cursor_update_timer(Client *p)
+{
+	Seat *st;
+	struct timespec now;
+	struct itimerspec it;
+	uint32_t ms,dur,min = 0;
+	int i,frame;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for(i = 0; i < p->seat_num; i++)
 	{
-		wl_display_flush(p->display);
+		st = p->seats[i];
 
-		//fds にセット (1〜)
+		if(!st->cursor || st->cursor->image_count < 2) continue;
 
-		num = 1;
+		ms = (now.tv_sec - st->cursor_start.tv_sec) * 1000
+			+ (now.tv_nsec - st->cursor_start.tv_nsec) / 1000000;
 
-		wl_list_for_each(pi, &p->list_poll, i)
-		{
-			fds[num].fd = pi->fd;
-			fds[num].events = pi->events;
-			ptr[num] = pi;
+		frame = wl_cursor_frame_and_duration(st->cursor, ms, &dur);
 
-			num++;
-			if(num == 10) break;
-		}
+		if(frame != st->cursor_frame)
+			_cursor_show_frame(st, frame);
 
-		//
+		//delay が 0 のフレームは止まったまま
 
-		poll(fds, num, -1);
+		if(!st->cursor->images[frame]->delay) continue;
 
-		if(fds[0].revents & POLLIN)
-			wl_display_dispatch(p->display);
+		if(!dur) dur = 1;
 
-		for(i = 1; i < num; i++)
-		{
-			if(fds[i].revents)
-				(ptr[i]->handle)(p, fds[i].fd, fds[i].revents);
-		}
+		if(!min || dur < min) min = dur;
 	}
-}
-
-/* poll 追加 */
 
-void Client_poll_add(Client *p,int fd,int events,poll_handle handle)
-{
-	PollItem *pi;
+	//0 で停止
 
-	pi = (PollItem *)calloc(1, sizeof(PollItem));
-	if(!pi) return;
+	memset(&it, 0, sizeof(it));
 
-	pi->fd = fd;
-	pi->events = events;
-	pi->handle = handle;
+	it.it_value.tv_sec = min / 1000;
+	it.it_value.tv_nsec = (min % 1000) * 1000000;
 
-	wl_list_insert(p->list_poll.prev, &pi->i);
+	timerfd_settime(p->cursor_timer_fd, 0, &it, NULL);
 }
 
-/* poll 削除 */
+/* アニメーションのタイマー */
 
-void Client_poll_delete(Client *p,int fd)
+static void _cursor_timer_handle(Client *p,int fd,int events)
 {
-	PollItem *pi;
+	uint64_t val;
 
-	wl_list_for_each(pi, &p->list_poll, i)
-	{
-		if(pi->fd == fd)
-		{
-			close(fd);
-			wl_list_remove(&pi->i);
+	if(read(fd, &val, sizeof(val)) < 0)
+		return;
 
-			free(pi);
-			break;
-		}
-	}
+	_cursor_update_timer(p);
 }
 
-/* poll 全て削除 */
+/* アニメーションを開始
+ *
+ * タイマーは最初に必要になった時に作成し、poll に追加する
+ * (Client_loop_poll() の時のみ動く) */
 
-void Client_poll_clear(Client *p)
+static void _cursor_start_timer(Client *p)
 {
-	PollItem *pi,*tmp;
+	int fd;
 
-	wl_list_for_each_safe(pi, tmp, &p->list_poll, i)
+	if(p->cursor_timer_fd < 0)
 	{
-		close(pi->fd);
-		
-		wl_list_remove(&pi->i);
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		if(fd < 0) return;
 
-		free(pi);
+		p->cursor_timer_fd = fd;
+
+		Client_poll_add(p, fd, POLLIN, _cursor_timer_handle);
 	}
+
+	_cursor_update_timer(p);
 }
 
 
 //========================
-// Window
+// グローバル
 //========================
 
 
-/* ウィンドウ作成
- *
- * listener: NULL でデフォルト。ハンドラを独自設定する場合に指定。 */
+/* wl_compositor */
 
-Window *Window_create(Client *cl,int width,int height,
-    const struct xdg_surface_listener *listener)
+static int _global_compositor_bind(Client *p,void *proxy,uint32_t ver)
 {
-	Window *p;
+	if(p->compositor) return 1;
 
-	p = (Window *)calloc(1, sizeof(Window));
-	if(!p) {
-        fprintf(stderr, "!p. return NULL\n");
-        return NULL;
-    }
-    fprintf(stderr, "p allocated!\n");
+	p->compositor = (struct wl_compositor *)proxy;
+	p->compositor_ver = ver;
 
-	p->client = cl;
-	p->width = width;
-	p->height = height;
+	return 0;
+}
 
-	//wl_surface
+static void _global_compositor_remove(Client *p,void *proxy)
+{
+	wl_compositor_destroy(p->compositor);
+	p->compositor = NULL;
+}
 
-	p->surface = wl_compositor_create_surface(cl->compositor);
+/* wl_shm
+ *
+ * 対応フォーマットを記録する */
 
-	//wl_shell_surface
+static void _shm_format(void *data,struct wl_shm *shm,uint32_t format)
+{
+	Client *p = (Client *)data;
+
+	switch(format)
+	{
+		case WL_SHM_FORMAT_ARGB8888:
+			p->shm_formats |= CLIENT_SHM_FORMAT_ARGB8888;
+			break;
+		case WL_SHM_FORMAT_XRGB8888:
+			p->shm_formats |= CLIENT_SHM_FORMAT_XRGB8888;
+			break;
+		case WL_SHM_FORMAT_RGB565:
+			p->shm_formats |= CLIENT_SHM_FORMAT_RGB565;
+			break;
+	}
+}
+
+static const struct wl_shm_listener g_shm_listener = {
+	_shm_format
+};
+
+static int _global_shm_bind(Client *p,void *proxy,uint32_t ver)
+{
+	if(p->shm) return 1;
+
+	p->shm = (struct wl_shm *)proxy;
+
+	wl_shm_add_listener(p->shm, &g_shm_listener, p);
+
+	/* ARGB8888/XRGB8888 は常に対応している。
+	 * それ以外を使う場合は、format イベントを初期化中に受け取るため同期させる */
+
+	if(p->image_format != WL_SHM_FORMAT_ARGB8888
+		&& p->image_format != WL_SHM_FORMAT_XRGB8888)
+		Client_add_init_sync(p);
+
+	return 0;
+}
+
+static void _global_shm_remove(Client *p,void *proxy)
+{
+	wl_shm_destroy(p->shm);
+	p->shm = NULL;
+}
+
+/* xdg_wm_base */
+
+static int _global_wm_base_bind(Client *p,void *proxy,uint32_t ver)
+{
+	if(p->wm_base) return 1;
+
+	p->wm_base = (struct xdg_wm_base *)proxy;
+
+	xdg_wm_base_add_listener(p->wm_base, &xdg_wm_base_listener, NULL);
+
+	return 0;
+}
+
+static void _global_wm_base_remove(Client *p,void *proxy)
+{
+	xdg_wm_base_destroy(p->wm_base);
+	p->wm_base = NULL;
+}
+
+/* wl_seat
+ *
+ * 複数の seat を Client::seats に詰めて保持する。
+ * Seat は Client::seat_size のサイズで確保される。 */
+
+static int _global_seat_bind(Client *p,void *proxy,uint32_t ver)
+{
+	Seat *st,**buf;
+	int n;
+
+	//配列を拡張
+
+	if(p->seat_num == p->seat_alloc)
+	{
+		n = (p->seat_alloc)? p->seat_alloc * 2: 4;
+
+		buf = (Seat **)realloc(p->seats, sizeof(Seat *) * n);
+		if(!buf) return 1;
+
+		p->seats = buf;
+		p->seat_alloc = n;
+	}
+
+	//Seat 作成
+
+	st = (Seat *)calloc(1, (p->seat_size > sizeof(Seat))? p->seat_size: sizeof(Seat));
+	if(!st) return 1;
+
+	st->client = p;
+	st->seat = (struct wl_seat *)proxy;
+	st->ver = ver;
+	st->index = p->seat_num;
+
+	p->seats[p->seat_num++] = st;
+
+	/* capabilities は初期化の完了を待たずに、イベントループ内で処理する。
+	 * (wl_pointer などの作成のために、往復を追加しない) */
+
+	wl_seat_add_listener(st->seat, &g_seat_listener, st);
+
+	if(p->seat_add)
+		(p->seat_add)(p, st);
+
+	return 0;
+}
+
+static void _global_seat_remove(Client *p,void *proxy)
+{
+	Seat *st;
+
+	st = (Seat *)wl_seat_get_user_data((struct wl_seat *)proxy);
+
+	//依存するオブジェクトを先に破棄
+
+	if(p->seat_remove)
+		(p->seat_remove)(p, st);
+
+	if(st->pointer)
+		_pointer_release(st);
+
+	if(st->keyboard)
+		_keyboard_release(st);
+
+	if(st->cursor_surface)
+		wl_surface_destroy(st->cursor_surface);
+
+	if(st->ver >= WL_SEAT_RELEASE_SINCE_VERSION)
+		wl_seat_release(st->seat);
+	else
+		wl_seat_destroy(st->seat);
+
+	//配列から削除 (最後の要素を移動)
+
+	p->seat_num--;
+
+	if(st->index != p->seat_num)
+	{
+		p->seats[st->index] = p->seats[p->seat_num];
+		p->seats[st->index]->index = st->index;
+	}
+
+	free(st);
+}
+
+/* wl_output
+ *
+ * スケールを取得するため ver 2 以上 */
+
+static int _global_output_bind(Client *p,void *proxy,uint32_t ver)
+{
+	Output *o,**buf;
+	int n;
+
+	if(p->output_num == p->output_alloc)
+	{
+		n = (p->output_alloc)? p->output_alloc * 2: 4;
+
+		buf = (Output **)realloc(p->outputs, sizeof(Output *) * n);
+		if(!buf) return 1;
+
+		p->outputs = buf;
+		p->output_alloc = n;
+	}
+
+	o = (Output *)calloc(1, sizeof(Output));
+	if(!o) return 1;
+
+	o->client = p;
+	o->output = (struct wl_output *)proxy;
+	o->scale = o->scale_pending = 1;
+
+	p->outputs[p->output_num++] = o;
+
+	wl_output_add_listener(o->output, &g_output_listener, o);
+
+	return 0;
+}
+
+/* wl_output の削除
+ *
+ * 表示中のウィンドウから外して、スケールを更新する */
+
+static void _global_output_remove(Client *p,void *proxy)
+{
+	Output *o;
+	int i;
+
+	o = (Output *)wl_output_get_user_data((struct wl_output *)proxy);
+
+	for(i = 0; i < p->window_num; i++)
+		_window_leave_output(p->windows[i], o->output);
+
+	for(i = 0; i < p->output_num; i++)
+	{
+		if(p->outputs[i] == o)
+		{
+			p->outputs[i] = p->outputs[--p->output_num];
+			break;
+		}
+	}
+
+	if(wl_proxy_get_version((struct wl_proxy *)o->output) >= WL_OUTPUT_RELEASE_SINCE_VERSION)
+		wl_output_release(o->output);
+	else
+		wl_output_destroy(o->output);
+
+	free(o);
+}
+
+/* wp_viewporter */
+
+static int _global_viewporter_bind(Client *p,void *proxy,uint32_t ver)
+{
+	if(p->viewporter) return 1;
+
+	p->viewporter = (struct wp_viewporter *)proxy;
+
+	return 0;
+}
+
+static void _global_viewporter_remove(Client *p,void *proxy)
+{
+	int i;
+
+	for(i = 0; i < p->window_num; i++)
+	{
+		if(p->windows[i]->viewport)
+		{
+			wp_viewport_destroy(p->windows[i]->viewport);
+			p->windows[i]->viewport = NULL;
+			p->windows[i]->committed.dst_w = -1;
+			p->windows[i]->scale_changed = 1;
+		}
+	}
+
+	wp_viewporter_destroy(p->viewporter);
+	p->viewporter = NULL;
+}
+
+/* wp_fractional_scale_manager_v1 */
+
+static int _global_fractional_bind(Client *p,void *proxy,uint32_t ver)
+{
+	if(p->fractional_scale_manager) return 1;
+
+	p->fractional_scale_manager = (struct wp_fractional_scale_manager_v1 *)proxy;
+
+	return 0;
+}
+
+static void _global_fractional_remove(Client *p,void *proxy)
+{
+	Window *win;
+	int i;
+
+	for(i = 0; i < p->window_num; i++)
+	{
+		win = p->windows[i];
+
+		if(win->fractional_scale)
+		{
+			wp_fractional_scale_v1_destroy(win->fractional_scale);
+			win->fractional_scale = NULL;
+			win->preferred_scale120 = 0;
+
+			_window_update_scale(win);
+		}
+	}
+
+	wp_fractional_scale_manager_v1_destroy(p->fractional_scale_manager);
+	p->fractional_scale_manager = NULL;
+}
+
+/* ver 4 以上で wl_surface.damage_buffer、
+ * ver 6 以上で wl_surface.preferred_buffer_scale を使う */
+
+static const ClientGlobal g_global_compositor = {
+	&wl_compositor_interface, 1, CLIENT_COMPOSITOR_VERSION,
+	_global_compositor_bind, _global_compositor_remove
+};
+
+static const ClientGlobal g_global_output = {
+	&wl_output_interface, 2, 2, _global_output_bind, _global_output_remove
+};
+
+static const ClientGlobal g_global_viewporter = {
+	&wp_viewporter_interface, 1, 1, _global_viewporter_bind, _global_viewporter_remove
+};
+
+static const ClientGlobal g_global_fractional = {
+	&wp_fractional_scale_manager_v1_interface, 1, 1,
+	_global_fractional_bind, _global_fractional_remove
+};
+
+static const ClientGlobal g_global_shm = {
+	&wl_shm_interface, 1, 1, _global_shm_bind, _global_shm_remove
+};
+
+static const ClientGlobal g_global_wm_base = {
+	&xdg_wm_base_interface, 1, 1, _global_wm_base_bind, _global_wm_base_remove
+};
+
+static const ClientGlobal g_global_seat = {
+	&wl_seat_interface, 1, 5, _global_seat_bind, _global_seat_remove
+};
+
+
+/* インターフェイス名のハッシュ (FNV-1a) */
+
+static uint32_t _global_hash(const char *name,uint32_t seed)
+{
+	uint32_t h = 2166136261U ^ seed;
+
+	for(; *name; name++)
+	{
+		h ^= (uint8_t)*name;
+		h *= 16777619U;
+	}
+
+	return h & (CLIENT_GLOBAL_HASH_SIZE - 1);
+}
+
+/* 完全ハッシュ表を作成
+ *
+ * 衝突しない種が見つかるまで、種を変えて試す。
+ * return: 0 で成功 */
+
+static int _global_hash_build(Client *p)
+{
+	uint32_t seed,h;
+	int i;
+
+	for(seed = 0; seed < 10000; seed++)
+	{
+		memset(p->global_hash, 0, CLIENT_GLOBAL_HASH_SIZE);
+
+		for(i = 0; i < p->global_num; i++)
+		{
+			h = _global_hash(p->globals[i]->iface->name, seed);
+
+			if(p->global_hash[h]) break;
+
+			p->global_hash[h] = i + 1;
+		}
+
+		if(i == p->global_num)
+		{
+			p->global_seed = seed;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* 名前からグローバルを検索 */
+
+static const ClientGlobal *_global_find(Client *p,const char *name)
+{
+	const ClientGlobal *g;
+	int n;
+
+	n = p->global_hash[_global_hash(name, p->global_seed)];
+	if(!n) return NULL;
+
+	g = p->globals[n - 1];
+
+	return (strcmp(g->iface->name, name) == 0)? g: NULL;
+}
+
+/* バインド済みのグローバルを解放 */
+
+static void _bound_release(Client *p,ClientBound *bound)
+{
+	if(bound->global->remove)
+		(bound->global->remove)(p, bound->proxy);
+	else
+		wl_proxy_destroy((struct wl_proxy *)bound->proxy);
+}
+
+/* バインド済みのグローバルを追加する位置を確保
+ *
+ * bind ハンドラの実行後に失敗しないように、バインド前に確保しておく。
+ * return: 0 で成功 */
+
+static int _bound_reserve(Client *p)
+{
+	ClientBound *buf;
+	int n;
+
+	if(p->bound_num == p->bound_alloc)
+	{
+		n = (p->bound_alloc)? p->bound_alloc * 2: 8;
+
+		buf = (ClientBound *)realloc(p->bound, sizeof(ClientBound) * n);
+		if(!buf) return -1;
+
+		p->bound = buf;
+		p->bound_alloc = n;
+	}
+
+	return 0;
+}
+
+/* バインド済みのグローバルを追加
+ *
+ * _bound_reserve() で確保済みであること */
+
+static void _bound_add(Client *p,uint32_t id,const ClientGlobal *global,void *proxy)
+{
+	ClientBound *buf;
+
+	buf = p->bound + p->bound_num;
+	buf->id = id;
+	buf->global = global;
+	buf->proxy = proxy;
+
+	p->bound_num++;
+}
+
+//========================
+// wl_registry
+//========================
+
+
+static void _registry_global(
+	void *data,struct wl_registry *reg,uint32_t id,const char *name,uint32_t ver)
+{
+	Client *p = (Client *)data;
+	const ClientGlobal *g;
+	void *proxy;
+
+	g = _global_find(p, name);
+	if(!g) return;
+
+	//バージョン
+
+	if(ver < g->min_ver)
+	{
+		fprintf(stderr, "%s: version %u is not supported (min %u)\n",
+			name, ver, g->min_ver);
+		return;
+	}
+
+	if(ver > g->max_ver) ver = g->max_ver;
+
+	//バインド
+
+	if(_bound_reserve(p)) return;
+
+	proxy = wl_registry_bind(reg, id, g->iface, ver);
+	if(!proxy) return;
+
+	if(g->bind && (g->bind)(p, proxy, ver))
+		wl_proxy_destroy((struct wl_proxy *)proxy);
+	else
+		_bound_add(p, id, g, proxy);
+}
+
+/* グローバルの削除
+ *
+ * 依存するオブジェクトは、各 remove ハンドラで破棄する */
+
+static void _registry_global_remove(void *data,struct wl_registry *registry,uint32_t id)
+{
+	Client *p = (Client *)data;
+	int i;
+
+	for(i = 0; i < p->bound_num; i++)
+	{
+		if(p->bound[i].id == id)
+		{
+			_bound_release(p, p->bound + i);
+
+			p->bound[i] = p->bound[--p->bound_num];
+			break;
+		}
+	}
+}
+
+static const struct wl_registry_listener g_registry_listener = {
+    .global = _registry_global,
+    .global_remove = _registry_global_remove,
+};
+
+
+//========================
+// Client
+//========================
+
+
+/* クライアント終了 */
+
+void Client_destroy(Client *p)
+{
+	if(p)
+	{
+		int i;
+
+		//破棄ハンドラ
+	
+		if(p->destroy)
+			(p->destroy)(p);
+	
+		/* 入力スレッド (キューはオブジェクトの破棄後に削除する)
+		 * ハンドラが poll の fd に書き込むことがあるので、先に終了する */
+
+		Client_input_thread_stop(p);
+
+		//poll
+
+		Client_poll_clear(p);
+
+		//残っているウィンドウ
+
+		while(p->window_num)
+			Window_destroy(p->windows[p->window_num - 1]);
+
+		free(p->windows);
+		free(p->dirty);
+	
+		//グローバル (バインドした逆順)
+
+		for(i = p->bound_num - 1; i >= 0; i--)
+			_bound_release(p, p->bound + i);
+
+		free(p->bound);
+		free(p->seats);
+		free(p->outputs);
+
+		//カーソルのテーマ (wl_buffer を破棄するので、切断前に行う)
+
+		for(i = 0; i < p->cursor_theme_num; i++)
+			wl_cursor_theme_destroy(p->cursor_themes[i].theme);
+
+		if(p->input_queue)
+			wl_event_queue_destroy(p->input_queue);
+
+		ShmArena_destroy(p->arena);
+
+		//接続前の場合は NULL
+
+		if(p->registry)
+			wl_registry_destroy(p->registry);
+
+		if(p->display)
+			wl_display_disconnect(p->display);
+
+		free(p);
+	}
+}
+
+/* Client データ確保
+ *
+ * size: 構造体のサイズ。sizeof(Client) 以下なら自動で最低サイズ。 */
+
+Client *Client_new(int size)
+{
+	Client *p;
+
+	if(size < sizeof(Client))
+		size = sizeof(Client);
+
+	p = (Client *)calloc(1, size);
+	if(!p) return NULL;
+
+	wl_list_init(&p->list_poll);
+
+	p->cursor_timer_fd = -1;
+
+	return p;
+}
+
+/* 処理するグローバルを追加
+ *
+ * 初期化前に呼ぶこと。global は初期化後も保持しておくこと。
+ * return: 0 で成功 */
+
+int Client_add_global(Client *p,const ClientGlobal *global)
+{
+	if(p->global_num == CLIENT_GLOBAL_MAX)
+		return -1;
+
+	p->globals[p->global_num++] = global;
+
+	return 0;
+}
+
+/* Wayland クライアントの初期化
+ *
+ * 接続して、レジストリの往復が終わるまで待つ
+ *
+ * return: 0 で成功。-1 で接続できなかった */
+
+int Client_init(Client *p)
+{
+	if(Client_connect(p)) return -1;
+
+	return Client_wait_init(p);
+}
+
+/* ディスプレイに接続して、レジストリを要求する
+ *
+ * 再接続モードの場合は、接続できるまで間隔を空けて繰り返す
+ * (10ms から倍々に、最大 1 秒。Client::reconnect_timeout まで)。
+ *
+ * return: 0 で成功 */
+
+static int _display_connect(Client *p)
+{
+	struct timespec start,now,ts;
+	int wait,timeout;
+
+	timeout = (p->reconnect_timeout > 0)? p->reconnect_timeout: 10000;
+	wait = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(1)
+	{
+		p->display = wl_display_connect(NULL);
+		if(p->display) break;
+
+		if(!p->reconnect) return -1;
+
+		//待つ
+
+		wait = (wait)? wait * 2: 10;
+		if(wait > 1000) wait = 1000;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000
+			+ wait > timeout)
+			return -1;
+
+		ts.tv_sec = wait / 1000;
+		ts.tv_nsec = (wait % 1000) * 1000000;
+
+		nanosleep(&ts, NULL);
+	}
+
+	//wl_registry
+
+	p->registry = wl_display_get_registry(p->display);
+
+	wl_registry_add_listener(p->registry, &g_registry_listener, p);
+
+	Client_add_init_sync(p);
+
+	wl_display_flush(p->display);
+
+	return 0;
+}
+
+/* 接続してレジストリを要求する
+ *
+ * 要求を送信した後、すぐに戻る。
+ * Client_wait_init() までの間に、イメージの確保や描画などを行える。
+ * 再接続モードの場合は、接続できるまで繰り返す (Client::reconnect_timeout まで)。
+ *
+ * return: 0 で成功。-1 で接続できなかった */
+
+int Client_connect(Client *p)
+{
+	clock_gettime(CLOCK_MONOTONIC, &p->time_connect);
+
+	//処理するグローバル
+
+	Client_add_global(p, &g_global_compositor);
+	Client_add_global(p, &g_global_shm);
+	Client_add_global(p, &g_global_wm_base);
+	Client_add_global(p, &g_global_output);
+	Client_add_global(p, &g_global_viewporter);
+	Client_add_global(p, &g_global_fractional);
+
+	/* Client::globals に追加して独自に wl_seat を処理する場合もあるので
+	 * フラグが ON の時のみ処理 */
+
+	if(p->init_flags & INIT_FLAGS_SEAT)
+		Client_add_global(p, &g_global_seat);
+
+	if(_global_hash_build(p))
+	{
+		fprintf(stderr, "failed to build the global hash table\n");
+		return -1;
+	}
+
+	//接続
+
+	if(_display_connect(p))
+	{
+		fprintf(stderr, "failed wl_display_connect\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* 初期処理が終わるまで待つ
+ *
+ * return: 0 で成功。-1 で途中で接続が切れた */
+
+int Client_wait_init(Client *p)
+{
+	while(p->disp_sync_cnt && wl_display_dispatch(p->display) != -1);
+
+	clock_gettime(CLOCK_MONOTONIC, &p->time_init);
+
+	return (wl_display_get_error(p->display))? -1: 0;
+}
+
+/* 初期化時の同期要求を追加
+ *
+ * 待つ必要があれば、バインドしてハンドラを設定した回数分実行する */
+
+void Client_add_init_sync(Client *p)
+{
+	struct wl_callback *callback;
+
+	callback = wl_display_sync(p->display);
+
+	wl_callback_add_listener(callback, &g_display_sync_listener, p);
+
+	p->disp_sync_cnt++;
+}
+
+/* 起動時間を出力
+ *
+ * 最初のコミット時に一度だけ呼ばれる */
+
+static double _timespec_diff_ms(const struct timespec *start,const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000.0
+		+ (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+void Client_report_startup(Client *p)
+{
+	struct timespec now;
+
+	if(p->startup_reported) return;
+
+	p->startup_reported = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	fprintf(stderr, "startup: connect -> init %.3f ms, connect -> first commit %.3f ms\n",
+		_timespec_diff_ms(&p->time_connect, &p->time_init),
+		_timespec_diff_ms(&p->time_connect, &now));
+}
+
+/* 要求を送信
+ *
+ * ソケットのバッファが一杯で送信しきれなかった場合、Client::flush_blocked が ON になる。
+ * イベントループは書き込み可能になるのを待って、再送信する。
+ *
+ * return: 0 で全て送信、1 で送信待ちあり、-1 でエラー */
+
+int Client_flush(Client *p)
+{
+	if(wl_display_flush(p->display) >= 0)
+	{
+		p->flush_blocked = 0;
+		return 0;
+	}
+	else if(errno == EAGAIN)
+	{
+		if(!p->flush_blocked)
+			p->flush_blocked_cnt++;
+
+		p->flush_blocked = 1;
+		return 1;
+	}
+	else
+		return -1;
+}
+
+/* ソケットの送信キューにあるバイト数を取得
+ *
+ * 相手がまだ読み込んでいない分。
+ * Client::flush_blocked が ON の時は、これに加えて libwayland 内に未送信の要求がある。 */
+
+int Client_get_send_queue(Client *p)
+{
+	int n;
+
+	if(ioctl(wl_display_get_fd(p->display), SIOCOUTQ, &n) < 0)
+		return 0;
+
+	return n;
+}
+
+/* 送信が詰まっているか
+ *
+ * 再描画など、大量の要求を送る処理は、これが 0 以外の間は送信を控える */
+
+int Client_is_congested(Client *p)
+{
+	return p->flush_blocked
+		|| (p->send_queue_limit > 0 && Client_get_send_queue(p) >= p->send_queue_limit);
+}
+
+/* 接続を閉じる (再接続用)
+ *
+ * すべてのプロキシを破棄する。切断後なので、要求は送信されない。
+ * ウィンドウのイメージのメモリや、Seat/Output 以外のクライアント側のデータは残る。 */
+
+static void _disconnect(Client *p)
+{
+	Window *win;
+	int i;
+
+	/* ウィンドウ
+	 * configure 前の状態にして、以降の更新は最初の configure まで保留する。
+	 * wl_output の破棄時にスケールが変わらないように、表示中の出力もクリア */
+
+	for(i = 0; i < p->window_num; i++)
+	{
+		win = p->windows[i];
+
+		//最後の更新と同じ方法で、最初の configure 時に更新する
+
+		if(win->configured)
+		{
+			win->pending_update = (win->state.opaque.w > 0)? WINDOW_UPDATE_OPAQUE: WINDOW_UPDATE_ALPHA;
+			win->configured = 0;
+		}
+
+		win->enter_output_num = 0;
+
+		_window_release_surface(win);
+	}
+
+	if(p->arena)
+		ShmArena_releasePool(p->arena);
+
+	//グローバル (バインドした逆順)
+
+	for(i = p->bound_num - 1; i >= 0; i--)
+		_bound_release(p, p->bound + i);
+
+	p->bound_num = 0;
+
+	//カーソルのテーマ
+
+	for(i = 0; i < p->cursor_theme_num; i++)
+		wl_cursor_theme_destroy(p->cursor_themes[i].theme);
+
+	p->cursor_theme_num = 0;
+
+	//
+
+	if(p->input_queue)
+	{
+		wl_event_queue_destroy(p->input_queue);
+		p->input_queue = NULL;
+	}
+
+	wl_registry_destroy(p->registry);
+	wl_display_disconnect(p->display);
+
+	p->registry = NULL;
+	p->display = NULL;
+
+	p->shm_formats = 0;
+	p->compositor_ver = 0;
+	p->disp_sync_cnt = 0;
+	p->flush_blocked = 0;
+}
+
+/* 再接続後、ウィンドウを作り直す
+ *
+ * コミットした状態を初期状態に戻して、wl_surface を作成する。
+ * サイズとスケールが変わらなければ、最初の configure 時に
+ * 保持しているイメージがそのまま表示される (描画し直さない)。 */
+
+static int _window_reconnect(Window *p)
+{
+	if(ImageBuf_createBuffer(p->img, p->client->shm))
+		return -1;
+
+	memset(&p->committed, 0, sizeof(WindowState));
+
+	p->committed.scale = 1;
+	p->committed.dst_w = p->committed.dst_h = -1;
+
+	p->damage_num = -1;
+	p->configure_pending = 0;
+
+	_window_create_surface(p);
+
+	return 0;
+}
+
+/* 接続が切れた時に再接続する
+ *
+ * プロトコルエラーの場合は、同じことを繰り返すので再接続しない。
+ * すべてのプロキシを破棄した後、接続し直してグローバルをバインドし、
+ * ウィンドウを作り直す。
+ * 入力スレッドを実行していた場合は、再度開始する。
+ *
+ * return: 0 で成功。-1 でイベントループを終了する */
+
+static int _reconnect(Client *p)
+{
+	struct timespec start,now;
+	int i,err,input,retry;
+
+	if(!p->reconnect || p->finish_loop) return -1;
+
+	err = wl_display_get_error(p->display);
+
+	if(err == EPROTO) return -1;
+
+	fprintf(stderr, "connection lost (%s), reconnecting\n", (err)? strerror(err): "hangup");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	//入力スレッド
+
+	input = p->input_running;
+
+	Client_input_thread_stop(p);
+
+	//接続 (必要なグローバルがない場合は、コンポジタの起動途中とみなして繰り返す)
+
+	for(retry = 0; ; retry++)
+	{
+		_disconnect(p);
+
+		if(retry == 10 || _display_connect(p))
+		{
+			fprintf(stderr, "failed to reconnect\n");
+			return -1;
+		}
+
+		if(Client_wait_init(p) == 0
+			&& p->compositor && p->shm && p->wm_base)
+			break;
+	}
+
+	//ウィンドウ
+
+	for(i = 0; i < p->window_num; i++)
+	{
+		if(_window_reconnect(p->windows[i]))
+			return -1;
+	}
+
+	if(input && Client_input_thread_start(p))
+		return -1;
+
+	if(p->reconnected)
+		(p->reconnected)(p);
+
+	Client_flush(p);
+
+	p->reconnect_cnt++;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	fprintf(stderr, "reconnected in %.3f ms\n", _timespec_diff_ms(&start, &now));
+
+	return 0;
+}
+
+/* イベントループ本体
+ *
+ * 接続が切れた場合、再接続モードなら再接続して続ける。
+ *
+ * use_list: Client::list_poll の fd も監視する */
+
+static void _loop(Client *p,int use_list)
+{
+	struct wl_display *disp = p->display;
+	struct pollfd fds[10];
+	int i,num,lost;
+	PollItem *pi,*ptr[10];
+
+	//fds[0] は Wayland イベント用
+
+	fds[0].fd = wl_display_get_fd(disp);
+
+	//
+
+	while(!p->finish_loop)
+	{
+		//キューにあるイベントを先に処理
+
+		lost = 0;
+
+		while(wl_display_prepare_read(disp) != 0)
+		{
+			if(wl_display_dispatch_pending(disp) < 0)
+			{
+				lost = 1;
+				break;
+			}
+		}
+
+		if(lost) goto LOST;
+
+		//再描画
+
+		if(p->dirty_num)
+			Client_redraw(p);
+
+		//送信 (送信しきれなければ、書き込み可能になるのを待つ)
+
+		if(Client_flush(p) < 0 && errno != EPIPE)
+		{
+			wl_display_cancel_read(disp);
+			goto LOST;
+		}
+
+		fds[0].events = POLLIN;
+
+		if(p->flush_blocked)
+			fds[0].events |= POLLOUT;
+
+		//fds にセット (1〜)
+
+		num = 1;
+
+		if(use_list)
+		{
+			wl_list_for_each(pi, &p->list_poll, i)
+			{
+				fds[num].fd = pi->fd;
+				fds[num].events = pi->events;
+				ptr[num] = pi;
+
+				num++;
+				if(num == 10) break;
+			}
+		}
+
+		//
+
+		if(poll(fds, num, -1) < 0)
+		{
+			wl_display_cancel_read(disp);
+
+			if(errno == EINTR) continue;
+			return;
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			if(wl_display_read_events(disp) < 0)
+				goto LOST;
+		}
+		else
+		{
+			wl_display_cancel_read(disp);
+
+			if(fds[0].revents & (POLLERR | POLLHUP))
+				goto LOST;
+		}
+
+		if(wl_display_dispatch_pending(disp) < 0)
+			goto LOST;
+
+		//書き込み可能になったので、残りを送信
+
+		if(fds[0].revents & POLLOUT)
+			Client_flush(p);
+
+		//ほかの fd
+
+		for(i = 1; i < num; i++)
+		{
+			if(fds[i].revents)
+				(ptr[i]->handle)(p, fds[i].fd, fds[i].revents);
+		}
+
+		continue;
+
+		//接続が切れた
+
+	LOST:
+		if(_reconnect(p)) return;
+
+		disp = p->display;
+		fds[0].fd = wl_display_get_fd(disp);
+	}
+}
+
+/* イベントループ (単純) */
+
+void Client_loop_simple(Client *p)
+{
+	_loop(p, 0);
+}
+
+/* イベントループ (poll) */
+
+void Client_loop_poll(Client *p)
+{
+	_loop(p, 1);
+}
+
+/* wl_shm のフォーマットに対応しているか */
+
+int Client_has_shm_format(Client *p,uint32_t format)
+{
+	switch(format)
+	{
+		//常に対応
+		case WL_SHM_FORMAT_ARGB8888:
+		case WL_SHM_FORMAT_XRGB8888:
+			return 1;
+		case WL_SHM_FORMAT_RGB565:
+			return ((p->shm_formats & CLIENT_SHM_FORMAT_RGB565) != 0);
+	}
+
+	return 0;
+}
+
+/* 共有メモリアリーナを取得
+ *
+ * なければ作成する。wl_shm のバインド前でも確保・描画できる。 */
+
+ShmArena *Client_get_arena(Client *p)
+{
+	if(!p->arena)
+		p->arena = ShmArena_new(0);
+
+	return p->arena;
+}
+
+/* アイドル時に物理メモリを解放
+ *
+ * ウィンドウのイメージの余分な確保分と、アリーナの未使用範囲を解放する。
+ * 表示中の内容はそのまま。
+ *
+ * return: 解放したバイト数 */
+
+int Client_trim(Client *p)
+{
+	int i,total = 0;
+
+	if(!p->arena) return 0;
+
+	for(i = 0; i < p->window_num; i++)
+		total += ImageBuf_trim(p->windows[i]->img);
+
+	return total + ShmArena_trim(p->arena);
+}
+
+/* wl_surface からウィンドウを取得
+ *
+ * ウィンドウ以外の wl_surface なら NULL
+ * (ウィンドウ以外の wl_surface のユーザーデータは NULL のままにしておくこと) */
+
+Window *Client_get_window(Client *p,struct wl_surface *surface)
+{
+	Window *win;
+
+	if(!surface) return NULL;
+
+	win = (Window *)wl_surface_get_user_data(surface);
+
+	return (win && win->index < p->window_num && p->windows[win->index] == win)? win: NULL;
+}
+
+/* ポインタのカーソルをセット
+ *
+ * wl_pointer.enter 時に呼ぶ。
+ * テーマはスケールごとに一度だけ読み込み、カーソル用の wl_surface は seat ごとに使い回す。
+ * アニメーションするカーソルは、描画とは関係なくタイマーでフレームを切り替える。
+ *
+ * surface: enter した wl_surface (ウィンドウのスケールに合わせる)
+ * name: カーソル名。テーマになければ "left_ptr"。
+ * return: 0 で成功 */
+
+int Client_set_cursor(Client *p,Seat *seat,uint32_t serial,struct wl_surface *surface,const char *name)
+{
+	ClientCursorTheme *ct;
+	struct wl_cursor *cursor = NULL;
+	Window *win;
+	int scale = 1;
+
+	if(!seat->pointer || !p->compositor) return -1;
+
+	//スケール (小数の場合は切り上げ。ver 3 未満は buffer_scale がないので 1)
+
+	win = Client_get_window(p, surface);
+
+	if(win && p->compositor_ver >= WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION)
+		scale = (win->scale120 + 119) / 120;
+
+	//カーソル
+
+	ct = _cursor_get_theme(p, scale);
+
+	if(ct)
+	{
+		cursor = wl_cursor_theme_get_cursor(ct->theme, name);
+
+		if(!cursor)
+			cursor = wl_cursor_theme_get_cursor(ct->theme, "left_ptr");
+	}
+
+	if(!cursor || !cursor->image_count) return -1;
+
+	seat->cursor_serial = serial;
+
+	//前回と同じ静止カーソルなら、サーフェスの内容はそのままで使う
+
+	if(seat->cursor_surface && seat->cursor == cursor
+		&& seat->cursor_scale == ct->scale && cursor->image_count == 1
+		&& seat->cursor_hot_x >= 0)
+	{
+		wl_pointer_set_cursor(seat->pointer, serial, seat->cursor_surface,
+			seat->cursor_hot_x, seat->cursor_hot_y);
+		return 0;
+	}
+
+	//カーソル用のサーフェス
+	//(ユーザーデータは NULL のまま。Client_get_window() で NULL になる)
+
+	if(!seat->cursor_surface)
+	{
+		seat->cursor_surface = wl_compositor_create_surface(p->compositor);
+		if(!seat->cursor_surface) return -1;
+	}
+
+	seat->cursor = cursor;
+	seat->cursor_scale = ct->scale;
+	seat->cursor_hot_x = seat->cursor_hot_y = -1;	//set_cursor を送る
+
+	clock_gettime(CLOCK_MONOTONIC, &seat->cursor_start);
+
+	_cursor_show_frame(seat, 0);
+
+	if(cursor->image_count > 1)
+		_cursor_start_timer(p);
+
+	return 0;
+}
+
+/* ポインタがウィンドウから出た時
+ *
+ * アニメーションを止める。
+ * 静止カーソルは、次の enter でそのまま使えるように残す。 */
+
+void Client_unset_cursor(Client *p,Seat *seat)
+{
+	if(seat->cursor && seat->cursor->image_count > 1)
+	{
+		seat->cursor = NULL;
+
+		if(p->cursor_timer_fd >= 0)
+			_cursor_update_timer(p);
+	}
+}
+
+/* 再描画が必要なウィンドウを描画して更新
+ *
+ * 送信が詰まっている間は行わない (次のループで再度行う) */
+
+void Client_redraw(Client *p)
+{
+	Window *win;
+
+	if(Client_is_congested(p)) return;
+
+	while(p->dirty_num)
+	{
+		win = p->dirty[--p->dirty_num];
+		win->dirty = 0;
+
+		//configure を適用してから描画
+
+		Window_applyConfigure(win);
+
+		if(win->draw)
+			(win->draw)(win);
+
+		if(win->opaque)
+			Window_updateOpaque(win);
+		else
+			Window_update(win);
+
+		if(win->updated)
+			(win->updated)(win);
+	}
+}
+
+/* 入力スレッド
+ *
+ * input_queue のイベントを読み込んで処理する。
+ * ハンドラは Client::input_mutex をロックした状態で実行される。 */
+
+static void *_input_thread(void *arg)
+{
+	Client *p = (Client *)arg;
+	struct wl_display *disp = p->display;
+	struct pollfd fds[2];
+	int ret;
+
+	fds[0].fd = wl_display_get_fd(disp);
+	fds[1].fd = p->input_wake_fd;
+	fds[1].events = POLLIN;
+
+	while(1)
+	{
+		//キューにあるイベントを処理
+
+		pthread_mutex_lock(&p->input_mutex);
+
+		while(wl_display_prepare_read_queue(disp, p->input_queue) != 0)
+		{
+			if(wl_display_dispatch_queue_pending(disp, p->input_queue) < 0)
+			{
+				pthread_mutex_unlock(&p->input_mutex);
+				return NULL;
+			}
+		}
+
+		pthread_mutex_unlock(&p->input_mutex);
+
+		//ハンドラ内での要求を送信
+
+		ret = wl_display_flush(disp);
+
+		fds[0].events = POLLIN;
+
+		if(ret < 0 && errno == EAGAIN)
+			fds[0].events |= POLLOUT;
+
+		//待つ
+
+		if(poll(fds, 2, -1) < 0)
+		{
+			wl_display_cancel_read(disp);
+
+			if(errno == EINTR) continue;
+			break;
+		}
+
+		//終了
+
+		if(fds[1].revents & POLLIN)
+		{
+			wl_display_cancel_read(disp);
+			break;
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			if(wl_display_read_events(disp) < 0)
+				break;
+		}
+		else
+		{
+			wl_display_cancel_read(disp);
+
+			if(fds[0].revents & (POLLERR | POLLHUP))
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+/* 入力用のイベントキューを取得
+ *
+ * なければ作成する。
+ * オブジェクトをキューに割り当てるには、ファクトリのラッパー
+ * (wl_proxy_create_wrapper) に wl_proxy_set_queue() でセットして作成すること。
+ * スレッドの開始前に作成しておけば、最初のイベントから取りこぼさない。 */
+
+struct wl_event_queue *Client_get_input_queue(Client *p)
+{
+	if(!p->input_queue)
+		p->input_queue = wl_display_create_queue(p->display);
+
+	return p->input_queue;
+}
+
+/* 入力スレッドを開始
+ *
+ * Client::input_queue のイベントを別スレッドで処理する。
+ *
+ * return: 0 で成功 */
+
+int Client_input_thread_start(Client *p)
+{
+	if(p->input_running) return 0;
+
+	if(!Client_get_input_queue(p)) return -1;
+
+	p->input_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(p->input_wake_fd < 0) return -1;
+
+	pthread_mutex_init(&p->input_mutex, NULL);
+
+	if(pthread_create(&p->input_thread, NULL, _input_thread, p))
+	{
+		pthread_mutex_destroy(&p->input_mutex);
+		close(p->input_wake_fd);
+		return -1;
+	}
+
+	p->input_running = 1;
+
+	return 0;
+}
+
+/* 入力スレッドを終了
+ *
+ * Client::input_queue は残る */
+
+void Client_input_thread_stop(Client *p)
+{
+	uint64_t val = 1;
+
+	if(!p->input_running) return;
+
+	if(write(p->input_wake_fd, &val, sizeof(val)) < 0)
+		return;
+
+	pthread_join(p->input_thread, NULL);
+
+	pthread_mutex_destroy(&p->input_mutex);
+	close(p->input_wake_fd);
+
+	p->input_running = 0;
+}
+
+/* 入力スレッドのハンドラと排他
+ *
+ * input_queue のオブジェクトが扱うデータに、メインスレッドからアクセスする時 */
+
+void Client_input_lock(Client *p)
+{
+	if(p->input_running)
+		pthread_mutex_lock(&p->input_mutex);
+}
+
+void Client_input_unlock(Client *p)
+{
+	if(p->input_running)
+		pthread_mutex_unlock(&p->input_mutex);
+}
+
+/* poll 追加 */
+
+void Client_poll_add(Client *p,int fd,int events,poll_handle handle)
+{
+	PollItem *pi;
+
+	pi = (PollItem *)calloc(1, sizeof(PollItem));
+	if(!pi) return;
+
+	pi->fd = fd;
+	pi->events = events;
+	pi->handle = handle;
+
+	wl_list_insert(p->list_poll.prev, &pi->i);
+}
+
+/* poll 削除 */
+
+void Client_poll_delete(Client *p,int fd)
+{
+	PollItem *pi;
+
+	wl_list_for_each(pi, &p->list_poll, i)
+	{
+		if(pi->fd == fd)
+		{
+			close(fd);
+			wl_list_remove(&pi->i);
+
+			free(pi);
+			break;
+		}
+	}
+}
+
+/* poll 全て削除 */
+
+void Client_poll_clear(Client *p)
+{
+	PollItem *pi,*tmp;
+
+	wl_list_for_each_safe(pi, tmp, &p->list_poll, i)
+	{
+		close(pi->fd);
+		
+		wl_list_remove(&pi->i);
+
+		free(pi);
+	}
+}
+
+
+//========================
+// Window
+//========================
+
+
+/* ウィンドウ作成
+ *
+ * listener: NULL でデフォルト。ハンドラを独自設定する場合に指定。 */
+
+Window *Window_create(Client *cl,int width,int height,
+    const struct xdg_surface_listener *listener)
+{
+	ImageBuf *img;
+	Window *p;
+	ShmArena *arena;
+
+	arena = Client_get_arena(cl);
+	if(!arena) return NULL;
+
+	img = ImageBuf_newArena(arena, width, height, cl->image_format);
+	if(!img) return NULL;
+
+	p = Window_createWithImage(cl, img, listener);
+	if(!p) ImageBuf_destroy(img);
+
+	return p;
+}
+
+/* ウィンドウをリストに追加 */
+
+static int _window_add(Client *cl,Window *p)
+{
+	Window **buf;
+	int n;
+
+	if(cl->window_num == cl->window_alloc)
+	{
+		n = (cl->window_alloc)? cl->window_alloc * 2: 8;
+
+		buf = (Window **)realloc(cl->windows, sizeof(Window *) * n);
+		if(!buf) return -1;
+
+		cl->windows = buf;
+
+		//dirty はウィンドウ数を超えない
+
+		buf = (Window **)realloc(cl->dirty, sizeof(Window *) * n);
+		if(!buf) return -1;
+
+		cl->dirty = buf;
+		cl->window_alloc = n;
+	}
+
+	p->index = cl->window_num;
+	cl->windows[cl->window_num++] = p;
+
+	return 0;
+}
+
+/* ウィンドウをリストから削除 */
+
+static void _window_remove(Client *cl,Window *p)
+{
+	int i;
+
+	//dirty
+
+	if(p->dirty)
+	{
+		for(i = 0; i < cl->dirty_num; i++)
+		{
+			if(cl->dirty[i] == p)
+			{
+				cl->dirty[i] = cl->dirty[--cl->dirty_num];
+				break;
+			}
+		}
+	}
+
+	//最後の要素を移動
+
+	cl->window_num--;
+
+	if(p->index != cl->window_num)
+	{
+		cl->windows[p->index] = cl->windows[cl->window_num];
+		cl->windows[p->index]->index = p->index;
+	}
+}
+
+/* wl_surface と、それに関連するオブジェクトを作成
+ *
+ * 作成後、バッファなしで最初のコミットを行い、configure を要求する。
+ * ウィンドウ作成時と再接続時。 */
+
+static void _window_create_surface(Window *p)
+{
+	Client *cl = p->client;
+
+	//wl_surface
+
+	p->surface = wl_compositor_create_surface(cl->compositor);
+
+	wl_surface_add_listener(p->surface, &g_surface_listener, p);
+
+	//スケール
+
+	if(cl->viewporter)
+		p->viewport = wp_viewporter_get_viewport(cl->viewporter, p->surface);
+
+	if(cl->fractional_scale_manager && p->viewport)
+	{
+		p->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+			cl->fractional_scale_manager, p->surface);
+
+		wp_fractional_scale_v1_add_listener(p->fractional_scale,
+			&g_fractional_scale_listener, p);
+	}
+
+	//xdg_surface
 	
-//	p->shell_surface = wl_shell_get_shell_surface(cl->shell, p->surface);
     p->xdg_surface = xdg_wm_base_get_xdg_surface(cl->wm_base, p->surface);
-
-//    xdg_surface_set_toplevel(p->xdg_surface);
     p->toplevel = xdg_surface_get_toplevel(p->xdg_surface);
 
-    xdg_surface_add_listener(p->xdg_surface,
-        (listener)? listener: &g_xdg_surface_listener,
-		p);
+	xdg_toplevel_add_listener(p->toplevel, &g_xdg_toplevel_listener, p);
+
+    xdg_surface_add_listener(p->xdg_surface, p->xdg_surface_listener, p);
+
+	//configure を要求する
+
+	wl_surface_commit(p->surface);
+}
+
+/* wl_surface と、それに関連するオブジェクトを破棄
+ *
+ * イメージの wl_buffer も破棄する (メモリは残る) */
+
+static void _window_release_surface(Window *p)
+{
+	if(p->region_opaque)
+	{
+		wl_region_destroy(p->region_opaque);
+		p->region_opaque = NULL;
+	}
+
+	if(p->region_input)
+	{
+		wl_region_destroy(p->region_input);
+		p->region_input = NULL;
+	}
+
+	if(p->fractional_scale)
+	{
+		wp_fractional_scale_v1_destroy(p->fractional_scale);
+		p->fractional_scale = NULL;
+	}
+
+	if(p->viewport)
+	{
+		wp_viewport_destroy(p->viewport);
+		p->viewport = NULL;
+	}
+
+	if(p->toplevel)
+	{
+		xdg_toplevel_destroy(p->toplevel);
+		p->toplevel = NULL;
+	}
+
+	if(p->xdg_surface)
+	{
+		xdg_surface_destroy(p->xdg_surface);
+		p->xdg_surface = NULL;
+	}
+
+	if(p->surface)
+	{
+		wl_surface_destroy(p->surface);
+		p->surface = NULL;
+	}
+
+	ImageBuf_releaseBuffer(p->img);
+}
+
+/* 確保済みのイメージからウィンドウ作成
+ *
+ * img: ImageBuf_new()/ImageBuf_newArena() で事前に確保・描画したもの。
+ *  ウィンドウが所有する。
+ * listener: 独自に設定する場合、最初の configure 時に
+ *  pending_update の処理を行うこと。
+ *
+ * 作成後、バッファなしで最初のコミットを行う。
+ * 内容は最初の configure 時に表示される。 */
+
+Window *Window_createWithImage(Client *cl,ImageBuf *img,
+    const struct xdg_surface_listener *listener)
+{
+	Window *p;
+
+	if(ImageBuf_createBuffer(img, cl->shm))
+		return NULL;
+
+	p = (Window *)calloc(1, sizeof(Window));
+	if(!p) return NULL;
+
+	p->client = cl;
+	p->img = img;
+	p->width = img->width;
+	p->height = img->height;
+
+	//wl_surface の初期状態
+
+	p->state.scale = p->committed.scale = 1;
+	p->state.dst_w = p->state.dst_h = -1;
+	p->committed.dst_w = p->committed.dst_h = -1;
+
+	p->scale120 = p->render_scale120 = 120;
+	p->damage_num = -1;
+
+	if(_window_add(cl, p))
+	{
+		free(p);
+		return NULL;
+	}
 
-	//イメージ作成
+	p->xdg_surface_listener = (listener)? listener: &g_xdg_surface_listener;
 
-	p->img = ImageBuf_create(cl->shm, width, height);
+	_window_create_surface(p);
 
 	return p;
 }
@@ -487,8 +2358,8 @@ void Window_destroy(Window *p)
 {
 	if(p)
 	{
-        xdg_surface_destroy(p->xdg_surface);
-		wl_surface_destroy(p->surface);
+		_window_remove(p->client, p);
+		_window_release_surface(p);
 
 		ImageBuf_destroy(p->img);
 
@@ -496,34 +2367,433 @@ void Window_destroy(Window *p)
 	}
 }
 
+/* 再描画が必要な状態にする
+ *
+ * イベントループで Client_redraw() が呼ばれ、draw ハンドラで描画してコミットされる */
+
+void Window_setDirty(Window *p)
+{
+	Client *cl = p->client;
+
+	if(!p->dirty)
+	{
+		p->dirty = 1;
+		cl->dirty[cl->dirty_num++] = p;
+	}
+}
+
+/* 適用するスケールを再計算
+ *
+ * 優先順: wp_fractional_scale_v1 > wl_surface.preferred_buffer_scale > wl_output のスケール (最大) */
+
+static void _window_update_scale(Window *p)
+{
+	Output *o;
+	int i,scale;
+
+	scale = p->preferred_scale120;
+
+	if(scale <= 0)
+	{
+		scale = 1;
+
+		for(i = 0; i < p->enter_output_num; i++)
+		{
+			o = (Output *)wl_output_get_user_data(p->enter_outputs[i]);
+
+			if(o && o->scale > scale)
+				scale = o->scale;
+		}
+
+		scale *= 120;
+	}
+
+	if(scale != p->scale120)
+	{
+		p->scale120 = scale;
+		p->scale_changed = 1;
+
+		Window_setDirty(p);
+	}
+}
+
+/* サーフェスのサイズとスケールから、イメージのサイズを決めて適用
+ *
+ * 整数倍なら wl_surface.set_buffer_scale、
+ * それ以外 (小数倍・低解像度モード) は wp_viewport で出力サイズを指定する。
+ *
+ * return: 0 で成功 */
+
+static int _window_apply_size(Window *p,int w,int h)
+{
+	int scale,bw,bh,n;
+
+	scale = p->scale120;
+
+	if(p->low_power && p->viewport)
+		scale /= 2;
+
+	if(p->viewport && scale % 120)
+	{
+		bw = (w * scale + 60) / 120;
+		bh = (h * scale + 60) / 120;
+		n = 1;
+	}
+	else
+	{
+		n = scale / 120;
+		if(n < 1) n = 1;
+
+		bw = w * n;
+		bh = h * n;
+		scale = n * 120;
+	}
+
+	if(bw < 1) bw = 1;
+	if(bh < 1) bh = 1;
+
+	if(ImageBuf_resize(p->img, p->client->shm, bw, bh))
+		return -1;
+
+	p->width = w;
+	p->height = h;
+	p->render_scale120 = scale;
+	p->scale_changed = 0;
+
+	p->state.scale = n;
+
+	if(n == 1 && (bw != w || bh != h))
+	{
+		p->state.dst_w = w;
+		p->state.dst_h = h;
+	}
+	else
+		p->state.dst_w = p->state.dst_h = -1;
+
+	return 0;
+}
+
+/* 未適用の configure を適用して応答
+ *
+ * 連続した configure のうち、最後のサイズだけを適用する。
+ * イメージは確保済みのサイズに収まれば再利用される。
+ * 更新時に自動で呼ばれるが、描画前に呼べばサイズ変更後に描画できる。 */
+
+void Window_applyConfigure(Window *p)
+{
+	int w,h;
+
+	if(!p->configure_pending && !p->scale_changed) return;
+
+	//0 の場合は現在のサイズ
+
+	w = p->width;
+	h = p->height;
+
+	if(p->configure_pending)
+	{
+		if(p->configure_width > 0) w = p->configure_width;
+		if(p->configure_height > 0) h = p->configure_height;
+	}
+
+	if(w != p->width || h != p->height || p->scale_changed)
+	{
+		if(_window_apply_size(p, w, h) == 0 && p->configure)
+			(p->configure)(p, w, h);
+	}
+
+	if(p->configure_pending)
+	{
+		p->configure_pending = 0;
+
+		xdg_surface_ack_configure(p->xdg_surface, p->configure_serial);
+	}
+}
+
+/* 全体の更新範囲を追加
+ *
+ * wl_compositor ver 4 以上ならバッファ座標で指定する */
+
+static void _window_damage(Window *p)
+{
+	WindowRect *rc;
+	ImageBuf *img = p->img;
+	int i,x1,y1,x2,y2,buffer_damage;
+
+	buffer_damage = (p->client->compositor_ver >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION);
+
+	//範囲の指定がない、またはバッファが変わった場合は全体
+
+	if(p->damage_num < 0 || p->state.buffer != p->committed.buffer)
+	{
+		if(buffer_damage)
+			wl_surface_damage_buffer(p->surface, 0, 0, img->width, img->height);
+		else
+			wl_surface_damage(p->surface, 0, 0, p->width, p->height);
+
+		return;
+	}
+
+	for(i = p->damage_num, rc = p->damage; i > 0; i--, rc++)
+	{
+		if(buffer_damage)
+			wl_surface_damage_buffer(p->surface, rc->x, rc->y, rc->w, rc->h);
+		else
+		{
+			//サーフェスの座標 (外側に丸める)
+
+			x1 = rc->x * p->width / img->width;
+			y1 = rc->y * p->height / img->height;
+			x2 = ((rc->x + rc->w) * p->width + img->width - 1) / img->width;
+			y2 = ((rc->y + rc->h) * p->height + img->height - 1) / img->height;
+
+			wl_surface_damage(p->surface, x1, y1, x2 - x1, y2 - y1);
+		}
+	}
+}
+
+/* wl_region の状態を送信
+ *
+ * 範囲が変わった時だけ呼ばれる。wl_region はウィンドウごとに1つを使い回す。 */
+
+static void _window_send_region(Window *p,struct wl_region **ppregion,
+	const WindowRect *old,const WindowRect *rect,
+	void (*set)(struct wl_surface *,struct wl_region *))
+{
+	struct wl_region *region = *ppregion;
+
+	if(rect->w <= 0 || rect->h <= 0)
+	{
+		(set)(p->surface, NULL);
+
+		//内容が残らないように破棄
+
+		if(region)
+		{
+			wl_region_destroy(region);
+			*ppregion = NULL;
+		}
+		return;
+	}
+
+	if(!region)
+		region = *ppregion = wl_compositor_create_region(p->client->compositor);
+	else if(old->w > 0 && old->h > 0)
+		wl_region_subtract(region, old->x, old->y, old->w, old->h);
+
+	wl_region_add(region, rect->x, rect->y, rect->w, rect->h);
+
+	(set)(p->surface, region);
+}
+
+static int _rect_equal(const WindowRect *a,const WindowRect *b)
+{
+	if(a->w <= 0 || a->h <= 0)
+		return (b->w <= 0 || b->h <= 0);
+
+	return (a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h);
+}
+
+/* コミット
+ *
+ * 前回のコミットから変わった状態だけを送信する。
+ * damage: 内容を更新した (バッファを再度 attach する) */
+
+static void _window_commit(Window *p,int damage)
+{
+	WindowState *st = &p->state,
+		*cm = &p->committed;
+	uint32_t ver = p->client->compositor_ver;
+
+	st->buffer = p->img->buffer;
+
+	//バッファ
+
+	if(st->buffer != cm->buffer || damage)
+	{
+		wl_surface_attach(p->surface, st->buffer, 0, 0);
+
+		if(damage) _window_damage(p);
+	}
+
+	//スケール・変換
+
+	if(st->scale != cm->scale && ver >= WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION)
+		wl_surface_set_buffer_scale(p->surface, st->scale);
+
+	if(st->transform != cm->transform && ver >= WL_SURFACE_SET_BUFFER_TRANSFORM_SINCE_VERSION)
+		wl_surface_set_buffer_transform(p->surface, st->transform);
+
+	if(p->viewport && (st->dst_w != cm->dst_w || st->dst_h != cm->dst_h))
+		wp_viewport_set_destination(p->viewport, st->dst_w, st->dst_h);
+
+	//範囲
+
+	if(!_rect_equal(&st->opaque, &cm->opaque))
+	{
+		_window_send_region(p, &p->region_opaque, &cm->opaque, &st->opaque,
+			wl_surface_set_opaque_region);
+	}
+
+	if(!_rect_equal(&st->input, &cm->input))
+	{
+		_window_send_region(p, &p->region_input, &cm->input, &st->input,
+			wl_surface_set_input_region);
+	}
+
+	wl_surface_commit(p->surface);
+
+	*cm = *st;
+
+	p->damage_num = -1;
+
+	Client_report_startup(p->client);
+}
+
 /* ウィンドウ更新
  *
- * 常にアルファ処理を行う */
+ * 常にアルファ処理を行う。
+ * 最初の configure の前なら、configure 時まで保留する。 */
 
 void Window_update(Window *p)
 {
-	wl_surface_attach(p->surface, p->img->buffer, 0, 0);
-	wl_surface_damage(p->surface, 0, 0, p->width, p->height);
+	if(!p->configured)
+	{
+		p->pending_update = WINDOW_UPDATE_ALPHA;
+		return;
+	}
 
-	wl_surface_commit(p->surface);
+	Window_applyConfigure(p);
+
+	p->state.opaque.w = 0;
+
+	//アルファ値を使う
+
+	if(p->img->format == WL_SHM_FORMAT_XRGB8888)
+		ImageBuf_setFormat(p->img, p->client->shm, WL_SHM_FORMAT_ARGB8888);
+
+	_window_commit(p, 1);
 }
 
 /* ウィンドウ更新
  *
- * すべて不透明として扱う */
+ * すべて不透明として扱う。
+ * 不透明範囲はサイズが変わった時だけ送信される。 */
 
 void Window_updateOpaque(Window *p)
 {
-	struct wl_region *region;
+	if(!p->configured)
+	{
+		p->pending_update = WINDOW_UPDATE_OPAQUE;
+		return;
+	}
 
-	wl_surface_attach(p->surface, p->img->buffer, 0, 0);
-	wl_surface_damage(p->surface, 0, 0, p->width, p->height);
+	Window_applyConfigure(p);
 
-	//完全不透明範囲セット
-	region = wl_compositor_create_region(p->client->compositor);
-	wl_region_add(region, 0, 0, p->width, p->height);
-	wl_surface_set_opaque_region(p->surface, region);
-	wl_region_destroy(region);
+	Window_setOpaqueRect(p, 0, 0, p->width, p->height);
 
-	wl_surface_commit(p->surface);
+	//アルファ値のないフォーマットにして、合成を省けるようにする
+
+	if(p->img->format == WL_SHM_FORMAT_ARGB8888)
+		ImageBuf_setFormat(p->img, p->client->shm, WL_SHM_FORMAT_XRGB8888);
+
+	_window_commit(p, 1);
+}
+
+/* 更新範囲の指定を開始
+ *
+ * 次の更新では、Window_addDamage() で追加した範囲だけが damage として送られる。
+ * (追加しなければ内容の変更なし)
+ * 呼ばない場合は、イメージ全体となる。 */
+
+void Window_beginDamage(Window *p)
+{
+	p->damage_num = 0;
+}
+
+/* 更新範囲を追加 (イメージの座標)
+ *
+ * 最大数を超える場合は、最後の範囲と結合する */
+
+void Window_addDamage(Window *p,int x,int y,int w,int h)
+{
+	WindowRect *rc;
+	int x2,y2;
+
+	if(p->damage_num < 0 || w <= 0 || h <= 0) return;
+
+	if(p->damage_num < WINDOW_DAMAGE_MAX)
+	{
+		rc = p->damage + p->damage_num++;
+
+		rc->x = x, rc->y = y;
+		rc->w = w, rc->h = h;
+	}
+	else
+	{
+		rc = p->damage + WINDOW_DAMAGE_MAX - 1;
+
+		x2 = (x + w > rc->x + rc->w)? x + w: rc->x + rc->w;
+		y2 = (y + h > rc->y + rc->h)? y + h: rc->y + rc->h;
+
+		if(x < rc->x) rc->x = x;
+		if(y < rc->y) rc->y = y;
+
+		rc->w = x2 - rc->x;
+		rc->h = y2 - rc->y;
+	}
+}
+
+/* 不透明範囲をセット (w <= 0 で空)
+ *
+ * 次の更新時に、変わっていれば送信される */
+
+void Window_setOpaqueRect(Window *p,int x,int y,int w,int h)
+{
+	p->state.opaque.x = x;
+	p->state.opaque.y = y;
+	p->state.opaque.w = w;
+	p->state.opaque.h = h;
+}
+
+/* 入力範囲をセット (w <= 0 で無限) */
+
+void Window_setInputRect(Window *p,int x,int y,int w,int h)
+{
+	p->state.input.x = x;
+	p->state.input.y = y;
+	p->state.input.w = w;
+	p->state.input.h = h;
+}
+
+/* バッファのスケールをセット */
+
+void Window_setBufferScale(Window *p,int scale)
+{
+	p->state.scale = scale;
+}
+
+/* 低解像度モード
+ *
+ * 適用するスケールの半分の解像度で描画して、コンポジタに拡大させる。
+ * 鮮明さと引き換えに、描画の負荷を減らす。wp_viewporter が必要。 */
+
+void Window_setLowPower(Window *p,int on)
+{
+	on = (on != 0);
+
+	if(on != p->low_power)
+	{
+		p->low_power = on;
+		p->scale_changed = 1;
+
+		Window_setDirty(p);
+	}
+}
+
+/* バッファの変換をセット (WL_OUTPUT_TRANSFORM_*) */
+
+void Window_setBufferTransform(Window *p,int transform)
+{
+	p->state.transform = transform;
 }
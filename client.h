@@ -5,11 +5,15 @@
 #ifndef _CLIENT_H_
 #define _CLIENT_H_
 
+#include <time.h>
+#include <pthread.h>
 #include <wayland-client.h>
 #include "xdg-shell-client-protocol.h"
 
 typedef struct _Client Client;
+typedef struct _Window Window;
 typedef struct _ImageBuf ImageBuf;
+typedef struct _ShmArena ShmArena;
 
 
 /*---- poll ----*/
@@ -25,14 +29,102 @@ typedef struct
 }PollItem;
 
 
+/*---- グローバル ----*/
+
+/* バインド後のハンドラ
+ *
+ * return: 0 以外で、このオブジェクトを使わない (破棄される) */
+typedef int (*client_global_bind)(Client *p,void *proxy,uint32_t ver);
+
+/* global_remove 時/クライアント破棄時のハンドラ
+ *
+ * proxy と、それに依存するオブジェクトを破棄すること */
+typedef void (*client_global_remove)(Client *p,void *proxy);
+
+/* 処理するインターフェイスの定義 */
+
+typedef struct
+{
+	const struct wl_interface *iface;	//インターフェイス (名前は iface->name)
+	uint32_t min_ver,	//これより低いバージョンはバインドしない
+		max_ver;		//このバージョンまでバインドする
+	client_global_bind bind;		//NULL でバインドのみ
+	client_global_remove remove;	//NULL で wl_proxy_destroy()
+}ClientGlobal;
+
+/* バインド済みのグローバル */
+
+typedef struct
+{
+	uint32_t id;	//wl_registry の name
+	const ClientGlobal *global;
+	void *proxy;
+}ClientBound;
+
+#define CLIENT_GLOBAL_MAX        16
+#define CLIENT_GLOBAL_HASH_SIZE  64	//2 の累乗
+
+
+/*---- Seat ----*/
+
+/* wl_seat ごとのデータ
+ *
+ * Client::seat_size を指定すると、その分のサイズで確保される (独自データの追加用)。
+ * wl_pointer/wl_keyboard のハンドラの data は Seat * となる。 */
+
+typedef struct _Seat Seat;
+
+struct _Seat
+{
+	Client *client;
+	struct wl_seat *seat;
+	struct wl_pointer *pointer;
+	struct wl_keyboard *keyboard;
+	uint32_t ver;	//wl_seat のバージョン
+	int index;		//Client::seats 内の位置
+
+	//カーソル (Client_set_cursor())
+	struct wl_surface *cursor_surface;	//カーソル用 (wl_pointer.enter ごとに使い回す)
+	struct wl_cursor *cursor;			//表示中のカーソル (NULL でなし)
+	struct timespec cursor_start;		//アニメーションの開始時間
+	uint32_t cursor_serial;				//wl_pointer.enter のシリアル
+	int cursor_scale,		//カーソルのテーマのスケール
+		cursor_frame,		//表示中のフレーム
+		cursor_hot_x,		//wl_pointer.set_cursor で送ったホットスポット
+		cursor_hot_y;
+};
+
+
+/*---- Output ----*/
+
+typedef struct
+{
+	Client *client;
+	struct wl_output *output;
+	int scale,		//確定したスケール
+		scale_pending;	//done までの保留
+}Output;
+
+
+/*---- カーソル ----*/
+
+/* スケールごとに読み込んだカーソルのテーマ */
+
+typedef struct
+{
+	int scale;
+	struct wl_cursor_theme *theme;
+}ClientCursorTheme;
+
+#define CLIENT_CURSOR_THEME_MAX  4
+
+
 /*---- Client ----*/
 
 #define CLIENT(p)  ((Client *)(p))
 
-typedef void (*client_registry_global)(
-	void *data,struct wl_registry *reg,uint32_t id,const char *name,uint32_t ver);
-
-typedef void (*client_seat_capabilities)(Client *p,struct wl_seat *seat,uint32_t cap);
+typedef void (*client_seat_capabilities)(Client *p,Seat *seat,uint32_t cap);
+typedef void (*client_seat_handle)(Client *p,Seat *seat);
 
 
 struct _Client
@@ -43,24 +135,84 @@ struct _Client
 	struct wl_shm *shm;
 //	struct wl_shell *shell;
     struct xdg_wm_base *wm_base;
-	struct wl_seat *seat;
-	struct wl_pointer *pointer;
-	struct wl_keyboard *keyboard;
+
+	Seat **seats;	//すべての seat (0〜seat_num - 1 に詰めて格納)
+	int seat_num,
+		seat_alloc,
+		seat_size;	//Seat の確保サイズ (初期化前にセット)
+
+	Output **outputs;	//すべての wl_output
+	int output_num,
+		output_alloc;
+
+	struct wp_viewporter *viewporter;	//NULL で非対応
+	struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 
 	struct wl_list list_poll;	//poll のリスト
 
+	//カーソル
+	ClientCursorTheme cursor_themes[CLIENT_CURSOR_THEME_MAX];	//必要になった時に読み込む
+	const char *cursor_theme;	//テーマ名 (NULL で $XCURSOR_THEME か デフォルト。初期化前にセット)
+	int cursor_theme_num,
+		cursor_size,		//スケール 1 でのサイズ (0 で $XCURSOR_SIZE か 24。初期化前にセット)
+		cursor_timer_fd;	//アニメーション用の timerfd (-1 でなし)
+
+	//入力用のイベントキューとスレッド
+	struct wl_event_queue *input_queue;
+	pthread_t input_thread;
+	pthread_mutex_t input_mutex;	//input_queue のハンドラ実行中はロックされる
+	int input_wake_fd,		//スレッド終了用 (eventfd)
+		input_running;
+
 	uint32_t init_flags,	//初期化時に処理するフラグ (初期化前に明示的にセット)
-		seat_ver,			//wl_seat のバージョン
+		image_format,		//ウィンドウのイメージのフォーマット (WL_SHM_FORMAT_*。初期化前にセット)
+		shm_formats,		//wl_shm の対応フォーマット (CLIENT_SHM_FORMAT_*)
+		compositor_ver,		//wl_compositor のバージョン
 		disp_sync_cnt;		//同期を待つ回数
 
-	int finish_loop;	//0 以外にすると、イベントループを抜ける
+	//処理するグローバルと、インターフェイス名の完全ハッシュ表
+	const ClientGlobal *globals[CLIENT_GLOBAL_MAX];
+	uint8_t global_hash[CLIENT_GLOBAL_HASH_SIZE];	//globals のインデックス + 1 (0 で空)
+	uint32_t global_seed;	//ハッシュの種
+	int global_num;
+
+	//バインド済みのグローバル
+	ClientBound *bound;
+	int bound_num,
+		bound_alloc;
+
+	//ウィンドウ
+	ShmArena *arena;	//全ウィンドウのイメージを確保する共有メモリ
+	Window **windows,	//すべてのウィンドウ (0〜window_num - 1 に詰めて格納)
+		**dirty;		//再描画が必要なウィンドウ
+	int window_num,
+		window_alloc,
+		dirty_num;
+
+	int finish_loop,	//0 以外にすると、イベントループを抜ける
+		flush_blocked,		//送信しきれていない要求がある
+		flush_blocked_cnt,	//送信が詰まった回数
+		send_queue_limit;	//送信キューのバイト数がこれ以上なら混雑とみなす (0 で無効)
+
+	struct timespec time_connect,	//接続開始時間
+		time_init;					//初期化 (レジストリの往復) 完了時間
+	int startup_reported;			//最初のコミットの時間を出力済みか
+
+	//再接続
+	int reconnect,			//接続が切れた時に再接続する (初期化前にセット)
+		reconnect_timeout,	//再接続を試みる時間 (ms。0 で 10 秒)
+		reconnect_cnt;		//再接続した回数
 
 	//破棄時のハンドラ
 	void (*destroy)(Client *p);
-	//wl_registry:global イベント (必須インターフェイス以外の処理時)
-	client_registry_global registry_global;
 	//wl_seat:capabilities イベント
 	client_seat_capabilities seat_capabilities;
+	//wl_seat の追加時
+	client_seat_handle seat_add;
+	//wl_seat の削除時 (wl_seat に依存するオブジェクトを破棄する)
+	client_seat_handle seat_remove;
+	//再接続後 (ウィンドウを作り直した後)
+	void (*reconnected)(Client *p);
 
 	const struct wl_pointer_listener *pointer_listener;		//wl_pointer のハンドラ構造体
 	const struct wl_keyboard_listener *keyboard_listener;	//wl_keyboard のハンドラ構造体
@@ -73,14 +225,42 @@ enum
 	INIT_FLAGS_KEYBOARD = 1<<2
 };
 
+enum
+{
+	CLIENT_SHM_FORMAT_ARGB8888 = 1<<0,
+	CLIENT_SHM_FORMAT_XRGB8888 = 1<<1,
+	CLIENT_SHM_FORMAT_RGB565 = 1<<2
+};
+
 Client *Client_new(int size);
 void Client_destroy(Client *p);
 
-void Client_init(Client *p);
+int Client_add_global(Client *p,const ClientGlobal *global);
+int Client_init(Client *p);
+int Client_connect(Client *p);
+int Client_wait_init(Client *p);
 void Client_add_init_sync(Client *p);
+void Client_report_startup(Client *p);
+int Client_flush(Client *p);
+int Client_get_send_queue(Client *p);
+int Client_is_congested(Client *p);
 void Client_loop_simple(Client *p);
 void Client_loop_poll(Client *p);
 
+struct wl_event_queue *Client_get_input_queue(Client *p);
+int Client_input_thread_start(Client *p);
+void Client_input_thread_stop(Client *p);
+void Client_input_lock(Client *p);
+void Client_input_unlock(Client *p);
+
+int Client_has_shm_format(Client *p,uint32_t format);
+ShmArena *Client_get_arena(Client *p);
+int Client_trim(Client *p);
+Window *Client_get_window(Client *p,struct wl_surface *surface);
+void Client_redraw(Client *p);
+int Client_set_cursor(Client *p,Seat *seat,uint32_t serial,struct wl_surface *surface,const char *name);
+void Client_unset_cursor(Client *p,Seat *seat);
+
 void Client_poll_add(Client *p,int fd,int events,poll_handle handle);
 void Client_poll_delete(Client *p,int fd);
 void Client_poll_clear(Client *p);
@@ -88,9 +268,29 @@ void Client_poll_clear(Client *p);
 
 /*---- Window ----*/
 
-typedef struct _Window Window;
-
 typedef void (*window_configure)(Window *p,int width,int height);
+typedef void (*window_handle)(Window *p);
+
+typedef struct
+{
+	int x,y,w,h;	//w,h <= 0 で空
+}WindowRect;
+
+/* wl_surface の状態 */
+
+typedef struct
+{
+	struct wl_buffer *buffer;
+	WindowRect opaque,	//不透明範囲 (空で NULL)
+		input;			//入力範囲 (空で NULL = 無限)
+	int scale,
+		transform,
+		dst_w,			//wp_viewport の出力先サイズ (-1 で解除)
+		dst_h;
+}WindowState;
+
+#define WINDOW_OUTPUT_MAX  8
+#define WINDOW_DAMAGE_MAX  16
 
 struct _Window
 {
@@ -100,16 +300,68 @@ struct _Window
     struct xdg_toplevel *toplevel;
     struct xdg_surface *xdg_surface;
 	ImageBuf *img;
-	int width,height;
 
-	window_configure configure;
+	WindowState state,	//次のコミットでの状態
+		committed;		//最後にコミットした状態
+	struct wl_region *region_opaque,	//使い回す wl_region
+		*region_input;
+
+	WindowRect damage[WINDOW_DAMAGE_MAX];	//次のコミットで送る更新範囲 (イメージの座標)
+	int damage_num;		//-1 で指定なし (全体)
+
+	struct wp_viewport *viewport;	//wp_viewporter がなければ NULL
+	struct wp_fractional_scale_v1 *fractional_scale;
+	struct wl_output *enter_outputs[WINDOW_OUTPUT_MAX];	//表示されている wl_output
+	int enter_output_num,
+		preferred_scale120,	//wp_fractional_scale_v1 か wl_surface.preferred_buffer_scale (x120。0 でなし)
+		scale120,			//適用するスケール (x120)
+		render_scale120,	//実際に描画するスケール (x120。イメージのサイズ / width)
+		scale_changed,		//スケールが変わった (次の更新時に適用)
+		low_power;			//低解像度で描画してコンポジタに拡大させる
+
+	int width,height,	//サーフェスのサイズ (イメージのサイズはスケール後)
+		configured,		//最初の configure を受け取ったか
+		pending_update,	//configure 前に要求された更新 (WINDOW_UPDATE_*)
+		index,			//Client::windows 内の位置
+		dirty,			//再描画待ち
+		opaque,			//Client_redraw() で不透明として更新する
+		configure_pending,	//未適用の configure がある
+		configure_width,	//最後の xdg_toplevel.configure のサイズ (0 でクライアントが決める)
+		configure_height;
+	uint32_t configure_serial;	//未応答の xdg_surface.configure のシリアル
+
+	window_configure configure;	//サイズ変更後 (xdg_toplevel.configure の適用時)
+	window_handle draw,		//Client_redraw() 時の描画 (img に描画する)
+		updated,			//Client_redraw() でコミットした後
+		close;				//xdg_toplevel.close (NULL でイベントループを終了)
+	void *param;			//独自データ
+
+	const struct xdg_surface_listener *xdg_surface_listener;	//再接続時に作り直す用
+};
+
+enum
+{
+	WINDOW_UPDATE_NONE,
+	WINDOW_UPDATE_ALPHA,
+	WINDOW_UPDATE_OPAQUE
 };
 
 Window *Window_create(Client *cl,int width,int height,
     const struct xdg_surface_listener *listener);
+Window *Window_createWithImage(Client *cl,ImageBuf *img,
+    const struct xdg_surface_listener *listener);
 
 void Window_destroy(Window *p);
+void Window_setDirty(Window *p);
+void Window_applyConfigure(Window *p);
 void Window_update(Window *p);
 void Window_updateOpaque(Window *p);
+void Window_setOpaqueRect(Window *p,int x,int y,int w,int h);
+void Window_setInputRect(Window *p,int x,int y,int w,int h);
+void Window_beginDamage(Window *p);
+void Window_addDamage(Window *p,int x,int y,int w,int h);
+void Window_setBufferScale(Window *p,int scale);
+void Window_setBufferTransform(Window *p,int transform);
+void Window_setLowPower(Window *p,int on);
 
 #endif
@@ -0,0 +1,588 @@
+/******************************
+ * 描画のベンチマーク
+ ******************************/
+
+#define _GNU_SOURCE	//syscall
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include <wayland-client.h>
+
+#include "imagebuf.h"
+#include "drawlist.h"
+#include "drawbench.h"
+
+
+//1項目で描画するピクセル数の目安
+#define BENCH_PIXELS  (64 << 20)
+
+//計測の繰り返し回数 (最も速い回の時間を結果とする)
+#define BENCH_REPEAT  5
+
+/* 計測する描画
+ *
+ * src: DRAWOP_BLT の元イメージ。list: グリフを並べたリスト。
+ * return: 描画したピクセル数 */
+
+typedef long (*bench_func)(ImageBuf *img,ImageBuf *src,DrawList *list);
+
+typedef struct
+{
+	const char *name;
+	bench_func func;
+}BenchItem;
+
+/* 前回の結果 */
+
+typedef struct
+{
+	char name[32],
+		format[16];
+	int width,
+		height;
+	double ns;
+}BenchBase;
+
+/* ハードウェアカウンタ (fd が -1 で使えない) */
+
+typedef struct
+{
+	int fd_cycles,
+		fd_misses;
+	long long cycles,
+		misses;
+}BenchCounter;
+
+//幅、高さ、ゴールデンイメージと比較するか
+//(大きいサイズは描画範囲が広がるだけなので、比較しない)
+
+static const int g_sizes[][3] = {
+	{64, 64, 1}, {640, 480, 1}, {1920, 1080, 0}, {3840, 2160, 0}
+};
+
+static const uint32_t g_formats[] = {
+	WL_SHM_FORMAT_XRGB8888, WL_SHM_FORMAT_RGB565
+};
+
+
+//=====================
+// 描画
+//=====================
+
+
+static long _bench_fill(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	ImageBuf_fill(img, 0xff3060c0);
+
+	return (long)img->width * img->height;
+}
+
+static long _bench_fillH(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	ImageBuf_fillH(img, img->height / 4, img->height / 2, 0xffc06030);
+
+	return (long)img->width * (img->height / 2);
+}
+
+static long _bench_fillRect(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	int w = img->width * 3 / 4,
+		h = img->height * 3 / 4;
+
+	ImageBuf_fillRect(img, img->width / 8, img->height / 8, w, h, 0xff60c030);
+
+	return (long)w * h;
+}
+
+static long _bench_blendRect(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	int w = img->width * 3 / 4,
+		h = img->height * 3 / 4;
+
+	ImageBuf_blendRect(img, img->width / 8, img->height / 8, w, h, 0x80ffffff);
+
+	return (long)w * h;
+}
+
+/* 入れ子の四角形枠 */
+
+static long _bench_box(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	long n = 0;
+	int i,w,h;
+
+	for(i = 0; i * 2 < img->width && i * 2 < img->height; i += 4)
+	{
+		w = img->width - i * 2;
+		h = img->height - i * 2;
+
+		ImageBuf_box(img, i, i, w, h, 0xffe0e040);
+
+		n += (w >= 2 && h >= 2)? w * 2 + (h - 2) * 2: w * h;
+	}
+
+	return n;
+}
+
+/* 3ピクセルごとの斜めの点 */
+
+static long _bench_setPixel(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	long n = 0;
+	int x,y;
+
+	for(y = 0; y < img->height; y++)
+	{
+		for(x = y % 3; x < img->width; x += 3, n++)
+			ImageBuf_setPixel(img, x, y, 0xff40e0e0);
+	}
+
+	return n;
+}
+
+static long _bench_blt(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	ImageBuf_blt(img, 0, 0, src, 0, 0, img->width, img->height);
+
+	return (long)img->width * img->height;
+}
+
+static long _bench_glyphs(ImageBuf *img,ImageBuf *src,DrawList *list)
+{
+	DrawList_render(list, img, 0, 0, img->width, img->height);
+
+	return (long)img->width * img->height;
+}
+
+static const BenchItem g_items[] = {
+	{"fill", _bench_fill},
+	{"fillH", _bench_fillH},
+	{"fillRect", _bench_fillRect},
+	{"blendRect", _bench_blendRect},
+	{"box", _bench_box},
+	{"setPixel", _bench_setPixel},
+	{"blt", _bench_blt},
+	{"glyphs", _bench_glyphs}
+};
+
+#define BENCH_ITEM_NUM  (int)(sizeof(g_items) / sizeof(BenchItem))
+
+
+//=====================
+// 準備
+//=====================
+
+
+/* blt 元のグラデーション */
+
+static void _make_source(ImageBuf *img)
+{
+	int x,y;
+
+	for(y = 0; y < img->height; y++)
+	{
+		for(x = 0; x < img->width; x++)
+			ImageBuf_setPixel(img, x, y, 0xff000000 | ((x & 255) << 16) | ((y & 255) << 8) | ((x ^ y) & 255));
+	}
+}
+
+/* イメージ全体に文字を並べたリスト */
+
+static int _make_glyphs(DrawList *list,ImageBuf *img)
+{
+	char text[512];
+	int i,y,len;
+
+	DrawList_clear(list);
+
+	if(DrawList_fill(list, img, 0xffffffff)) return -1;
+
+	len = img->width / 8;
+	if(len > sizeof(text)) len = sizeof(text);
+
+	for(i = 0; i < len; i++)
+		text[i] = 'a' + i % 26;
+
+	for(y = 0; y < img->height; y += 16)
+	{
+		if(DrawList_glyphs(list, 0, y, 8, 16, 1, text, len, 0xff000000, (y / 16) & 1))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+//=====================
+// ハードウェアカウンタ
+//=====================
+
+
+static int _perf_open(uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void _counter_enable(int fd)
+{
+	if(fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static long long _counter_read(int fd)
+{
+	long long val;
+
+	if(fd < 0) return -1;
+
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	if(read(fd, &val, sizeof(val)) != sizeof(val))
+		return -1;
+
+	return val;
+}
+
+
+//=====================
+// 比較
+//=====================
+
+
+/* 前回の結果を読み込み
+ *
+ * return: 数 (-1 でエラー) */
+
+static int _load_base(const char *filename,BenchBase **dst)
+{
+	FILE *fp;
+	BenchBase *buf = NULL,*tmp,rec;
+	char line[256];
+	int num = 0,alloc = 0;
+
+	fp = fopen(filename, "r");
+	if(!fp) return -1;
+
+	while(fgets(line, sizeof(line), fp))
+	{
+		if(line[0] == '#') continue;
+
+		if(sscanf(line, "%31s %15s %d %d %lf", rec.name, rec.format,
+			&rec.width, &rec.height, &rec.ns) != 5)
+			continue;
+
+		if(num == alloc)
+		{
+			alloc = (alloc)? alloc * 2: 64;
+
+			tmp = (BenchBase *)realloc(buf, sizeof(BenchBase) * alloc);
+			if(!tmp) break;
+
+			buf = tmp;
+		}
+
+		buf[num++] = rec;
+	}
+
+	fclose(fp);
+
+	*dst = buf;
+
+	return num;
+}
+
+/* 前回の結果から検索 */
+
+static BenchBase *_find_base(BenchBase *base,int num,
+	const char *name,const char *format,int width,int height)
+{
+	for(; num > 0; num--, base++)
+	{
+		if(base->width == width && base->height == height
+			&& strcmp(base->name, name) == 0 && strcmp(base->format, format) == 0)
+			return base;
+	}
+
+	return NULL;
+}
+
+/* ゴールデンイメージと比較
+ *
+ * update: 0 以外で、ファイルがなければ現在のイメージを保存する
+ * return: "ok"/"diff"/"new"/"missing"/"error" */
+
+static const char *_check_golden(ImageBuf *img,const char *filename,int update)
+{
+	FILE *fp;
+	uint8_t *cur,*gold;
+	const char *ret = "error";
+	int w,h,max,size;
+
+	fp = fopen(filename, "rb");
+
+	if(!fp)
+	{
+		if(errno != ENOENT) return "error";
+
+		if(!update) return "missing";
+
+		return (ImageBuf_savePPM(img, filename) == 0)? "new": "error";
+	}
+
+	size = img->width * img->height * 3;
+
+	cur = (uint8_t *)malloc(size);
+	gold = (uint8_t *)malloc(size);
+
+	if(cur && gold)
+	{
+		if(fscanf(fp, "P6 %d %d %d", &w, &h, &max) == 3 && fgetc(fp) != EOF)
+		{
+			if(w != img->width || h != img->height || max != 255
+				|| fread(gold, 1, size, fp) != size)
+				ret = "diff";
+			else
+			{
+				ImageBuf_getRGB(img, cur);
+
+				ret = memcmp(cur, gold, size)? "diff": "ok";
+			}
+		}
+	}
+
+	free(cur);
+	free(gold);
+	fclose(fp);
+
+	return ret;
+}
+
+
+//=====================
+// 計測
+//=====================
+
+
+/* 1項目を計測
+ *
+ * 時間は、BENCH_REPEAT 回のうち最も速い回の値 (他のプロセスなどの影響を除く)。
+ * カウンタは全体の値。
+ *
+ * return: 全体で描画したピクセル数 */
+
+static long _measure(const BenchItem *item,ImageBuf *img,ImageBuf *src,DrawList *list,
+	BenchCounter *cnt,double *ns)
+{
+	struct timespec t1,t2;
+	double t;
+	long px;
+	int i,j,n;
+
+	//ウォームアップ
+
+	px = (item->func)(img, src, list);
+	if(px <= 0) return 0;
+
+	n = BENCH_PIXELS / BENCH_REPEAT / px;
+	if(n < 3) n = 3;
+	if(n > 100000) n = 100000;
+
+	//計測
+
+	_counter_enable(cnt->fd_cycles);
+	_counter_enable(cnt->fd_misses);
+
+	for(j = 0; j < BENCH_REPEAT; j++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		for(i = 0; i < n; i++)
+			(item->func)(img, src, list);
+
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		t = ((t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec)) / ((double)px * n);
+
+		if(j == 0 || t < *ns) *ns = t;
+	}
+
+	cnt->cycles = _counter_read(cnt->fd_cycles);
+	cnt->misses = _counter_read(cnt->fd_misses);
+
+	return px * n * BENCH_REPEAT;
+}
+
+/* 実行
+ *
+ * すべての項目を、各フォーマット・サイズで計測する。
+ * ゴールデンイメージは、クリアしたイメージに1回描画した結果で比較する。
+ *
+ * return: 0 で成功、1 で遅くなった項目かゴールデンイメージと異なる (ない) 項目がある、-1 でエラー */
+
+int DrawBench_run(const DrawBenchOpt *opt)
+{
+	FILE *fp = NULL;
+	ImageBuf *img,*src;
+	DrawList *list;
+	BenchCounter cnt;
+	BenchBase *base = NULL,*pb;
+	const char *fmtname,*golden;
+	char fname[1024],mark[32];
+	double ns,total_px;
+	int i,j,k,w,h,base_num = 0,ret = 0;
+
+	if(opt->base)
+	{
+		base_num = _load_base(opt->base, &base);
+
+		if(base_num < 0)
+		{
+			printf("[!] failed to read '%s'\n", opt->base);
+			return -1;
+		}
+	}
+
+	if(opt->output)
+	{
+		fp = fopen(opt->output, "w");
+
+		if(!fp)
+		{
+			printf("[!] failed to open '%s'\n", opt->output);
+			free(base);
+			return -1;
+		}
+
+		fprintf(fp, "#name\tformat\twidth\theight\tns_per_pixel\tcycles_per_pixel\tmisses_per_kpixel\tgolden\n");
+	}
+
+	list = DrawList_new();
+
+	cnt.fd_cycles = _perf_open(PERF_COUNT_HW_CPU_CYCLES);
+	cnt.fd_misses = _perf_open(PERF_COUNT_HW_CACHE_MISSES);
+
+	if(cnt.fd_cycles < 0)
+		printf("[!] hardware counters are not available\n");
+
+	for(k = 0; k < sizeof(g_formats) / sizeof(uint32_t) && list; k++)
+	{
+		fmtname = (g_formats[k] == WL_SHM_FORMAT_RGB565)? "rgb565": "xrgb8888";
+
+		for(j = 0; j < sizeof(g_sizes) / sizeof(g_sizes[0]); j++)
+		{
+			w = g_sizes[j][0];
+			h = g_sizes[j][1];
+
+			img = ImageBuf_newMemory(w, h, g_formats[k]);
+			src = ImageBuf_newMemory(w, h, g_formats[k]);
+
+			if(!img || !src || _make_glyphs(list, img))
+			{
+				ImageBuf_destroy(img);
+				ImageBuf_destroy(src);
+				ret = -1;
+				goto END;
+			}
+
+			_make_source(src);
+
+			for(i = 0; i < BENCH_ITEM_NUM; i++)
+			{
+				//ゴールデンイメージ
+
+				golden = "-";
+
+				if(opt->golden && g_sizes[j][2])
+				{
+					memset(img->data, 0, img->size);
+
+					(g_items[i].func)(img, src, list);
+
+					snprintf(fname, sizeof(fname), "%s/%s_%s_%dx%d.ppm",
+						opt->golden, g_items[i].name, fmtname, w, h);
+
+					golden = _check_golden(img, fname, opt->update);
+
+					if(strcmp(golden, "ok") != 0 && strcmp(golden, "new") != 0)
+						ret = 1;
+				}
+
+				//計測
+
+				total_px = _measure(g_items + i, img, src, list, &cnt, &ns);
+				if(!total_px) continue;
+
+				//前回と比較
+
+				mark[0] = 0;
+
+				pb = _find_base(base, base_num, g_items[i].name, fmtname, w, h);
+
+				if(pb && pb->ns > 0)
+				{
+					snprintf(mark, sizeof(mark), " %+.1f%%", (ns / pb->ns - 1) * 100);
+
+					if(ns > pb->ns * (100 + opt->threshold) / 100)
+					{
+						strcat(mark, " SLOW");
+						ret = 1;
+					}
+				}
+
+				printf("%-10s %-8s %4dx%-4d %8.3f ns/px %8.3f cyc/px %9.3f miss/kpx  golden:%s%s\n",
+					g_items[i].name, fmtname, w, h, ns,
+					(cnt.cycles < 0)? -1: cnt.cycles / total_px,
+					(cnt.misses < 0)? -1: cnt.misses * 1000 / total_px,
+					golden, mark);
+
+				if(fp)
+				{
+					fprintf(fp, "%s\t%s\t%d\t%d\t%.4f\t%.4f\t%.4f\t%s\n",
+						g_items[i].name, fmtname, w, h, ns,
+						(cnt.cycles < 0)? -1: cnt.cycles / total_px,
+						(cnt.misses < 0)? -1: cnt.misses * 1000 / total_px,
+						golden);
+				}
+			}
+
+			ImageBuf_destroy(img);
+			ImageBuf_destroy(src);
+		}
+	}
+
+END:
+	if(!list) ret = -1;
+
+	if(cnt.fd_cycles >= 0) close(cnt.fd_cycles);
+	if(cnt.fd_misses >= 0) close(cnt.fd_misses);
+
+	if(fp && fclose(fp)) ret = -1;
+
+	DrawList_destroy(list);
+	free(base);
+
+	return ret;
+}
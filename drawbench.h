@@ -0,0 +1,24 @@
+#ifndef _DRAWBENCH_H_
+#define _DRAWBENCH_H_
+
+/* 描画のベンチマーク
+ *
+ * コンポジタなしで、通常のメモリのイメージに各描画関数を実行して計測する。
+ * 結果はタブ区切りのテキストで出力し、前回の結果やゴールデンイメージと比較できる。
+ *
+ * 出力: 名前 フォーマット 幅 高さ ns/ピクセル サイクル/ピクセル
+ *       キャッシュミス/1000ピクセル ゴールデンイメージの比較結果
+ *  (ハードウェアカウンタが使えない場合は -1) */
+
+typedef struct
+{
+	const char *output,	//結果の出力先ファイル (NULL で標準出力のみ)
+		*golden,		//ゴールデンイメージ (PPM) のディレクトリ (NULL で比較しない)
+		*base;			//比較する前回の結果ファイル (NULL で比較しない)
+	int threshold,		//前回より何 % 遅ければ失敗とするか
+		update;			//0 以外で、ゴールデンイメージがなければ保存する (0 でなければ失敗)
+}DrawBenchOpt;
+
+int DrawBench_run(const DrawBenchOpt *opt);
+
+#endif
@@ -0,0 +1,480 @@
+/******************************
+ * 描画コマンドリスト
+ ******************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <wayland-client.h>
+
+#include "imagebuf.h"
+#include "drawlist.h"
+
+
+/* 作成 */
+
+DrawList *DrawList_new(void)
+{
+	return (DrawList *)calloc(1, sizeof(DrawList));
+}
+
+/* 削除 */
+
+void DrawList_destroy(DrawList *p)
+{
+	if(p)
+	{
+		free(p->ops);
+		free(p->text);
+		free(p);
+	}
+}
+
+/* コマンドをすべて削除 (バッファは残す) */
+
+void DrawList_clear(DrawList *p)
+{
+	p->num = 0;
+	p->text_len = 0;
+}
+
+/* バッファを解放 (コマンドもすべて削除) */
+
+void DrawList_freeBuffer(DrawList *p)
+{
+	free(p->ops);
+	free(p->text);
+
+	memset(p, 0, sizeof(DrawList));
+}
+
+/* コマンドを追加
+ *
+ * return: NULL で確保に失敗 */
+
+static DrawOp *_add_op(DrawList *p,int type,int x,int y,int w,int h,uint32_t col)
+{
+	DrawOp *op;
+	int n;
+
+	if(p->num == p->alloc)
+	{
+		n = (p->alloc)? p->alloc * 2: 64;
+
+		op = (DrawOp *)realloc(p->ops, sizeof(DrawOp) * n);
+		if(!op) return NULL;
+
+		p->ops = op;
+		p->alloc = n;
+	}
+
+	op = p->ops + p->num++;
+
+	memset(op, 0, sizeof(DrawOp));
+
+	op->type = type;
+	op->x = x;
+	op->y = y;
+	op->w = w;
+	op->h = h;
+	op->col = col;
+
+	return op;
+}
+
+/* イメージ全体を塗りつぶし */
+
+int DrawList_fill(DrawList *p,ImageBuf *img,uint32_t col)
+{
+	return _add_op(p, DRAWOP_FILLRECT, 0, 0, img->width, img->height, col)? 0: -1;
+}
+
+/* 四角形塗りつぶし */
+
+int DrawList_fillRect(DrawList *p,int x,int y,int w,int h,uint32_t col)
+{
+	return _add_op(p, DRAWOP_FILLRECT, x, y, w, h, col)? 0: -1;
+}
+
+/* 四角形をアルファ合成 */
+
+int DrawList_blendRect(DrawList *p,int x,int y,int w,int h,uint32_t col)
+{
+	return _add_op(p, DRAWOP_BLENDRECT, x, y, w, h, col)? 0: -1;
+}
+
+/* 四角形枠 */
+
+int DrawList_box(DrawList *p,int x,int y,int w,int h,uint32_t col)
+{
+	return _add_op(p, DRAWOP_BOX, x, y, w, h, col)? 0: -1;
+}
+
+/* 文字列
+ *
+ * フォントは持たないので、UTF-8 の1文字ごとに枠のセルを並べる。
+ * pad: セル内の余白 (枠は pad,pad*2 から)
+ * underline: 0 以外で下線 */
+
+int DrawList_glyphs(DrawList *p,int x,int y,int cell_w,int cell_h,int pad,
+	const char *text,int len,uint32_t col,int underline)
+{
+	DrawOp *op;
+	char *buf;
+	int i,n,cnt;
+
+	//文字列をコピー
+
+	if(p->text_len + len > p->text_alloc)
+	{
+		n = (p->text_alloc)? p->text_alloc: 256;
+
+		while(n < p->text_len + len)
+			n *= 2;
+
+		buf = (char *)realloc(p->text, n);
+		if(!buf) return -1;
+
+		p->text = buf;
+		p->text_alloc = n;
+	}
+
+	for(i = cnt = 0; i < len; i++)
+	{
+		if((text[i] & 0xc0) != 0x80) cnt++;
+	}
+
+	op = _add_op(p, DRAWOP_GLYPHS, x, y, cell_w * cnt, cell_h, col);
+	if(!op) return -1;
+
+	memcpy(p->text + p->text_len, text, len);
+
+	op->text = p->text_len;
+	op->len = len;
+	op->cell_w = cell_w;
+	op->pad = pad;
+	op->underline = underline;
+
+	p->text_len += len;
+
+	return 0;
+}
+
+/* イメージ転送
+ *
+ * src は描画先とは別のイメージであること。
+ * src の内容が変わっても DrawList_diff() では検出されない。 */
+
+int DrawList_blt(DrawList *p,int dx,int dy,ImageBuf *src,int sx,int sy,int w,int h)
+{
+	DrawOp *op;
+
+	op = _add_op(p, DRAWOP_BLT, dx, dy, w, h, 0);
+	if(!op) return -1;
+
+	op->src = src;
+	op->sx = sx;
+	op->sy = sy;
+
+	return 0;
+}
+
+
+//=====================
+// 実行
+//=====================
+
+
+typedef struct
+{
+	int x1,y1,x2,y2;	//x2,y2 は含まない
+}_ClipRect;
+
+/* 四角形を範囲内にクリッピング
+ * return: 0 で範囲なし */
+
+static int _clip(const _ClipRect *clip,int *x,int *y,int *w,int *h)
+{
+	int x2,y2;
+
+	x2 = *x + *w;
+	y2 = *y + *h;
+
+	if(*x < clip->x1) *x = clip->x1;
+	if(*y < clip->y1) *y = clip->y1;
+	if(x2 > clip->x2) x2 = clip->x2;
+	if(y2 > clip->y2) y2 = clip->y2;
+
+	*w = x2 - *x;
+	*h = y2 - *y;
+
+	return (*w > 0 && *h > 0);
+}
+
+/* クリッピングして塗りつぶし */
+
+static void _fill_clip(ImageBuf *img,const _ClipRect *clip,int x,int y,int w,int h,uint32_t col)
+{
+	if(_clip(clip, &x, &y, &w, &h))
+		ImageBuf_fillRect(img, x, y, w, h, col);
+}
+
+/* クリッピングして四角形枠 (ImageBuf_box() と同じ順で4辺) */
+
+static void _box_clip(ImageBuf *img,const _ClipRect *clip,int x,int y,int w,int h,uint32_t col)
+{
+	if(w <= 0 || h <= 0) return;
+
+	_fill_clip(img, clip, x, y, w, 1, col);
+	_fill_clip(img, clip, x, y + h - 1, w, 1, col);
+	_fill_clip(img, clip, x, y + 1, 1, h - 2, col);
+	_fill_clip(img, clip, x + w - 1, y + 1, 1, h - 2, col);
+}
+
+/* 文字列のセルを描画 */
+
+static void _glyphs_clip(DrawList *p,DrawOp *op,ImageBuf *img,const _ClipRect *clip)
+{
+	const char *pc = p->text + op->text;
+	int i,x,pad = op->pad;
+
+	x = op->x;
+
+	for(i = 0; i < op->len; i++)
+	{
+		if((pc[i] & 0xc0) == 0x80) continue;
+
+		//範囲外のセルは飛ばす
+
+		if(x < clip->x2 && x + op->cell_w > clip->x1)
+		{
+			_box_clip(img, clip, x + pad, op->y + pad * 2,
+				op->cell_w - pad * 2, op->h - pad * 4, op->col);
+
+			if(op->underline)
+				_box_clip(img, clip, x, op->y + op->h - pad, op->cell_w, pad, op->col);
+		}
+
+		x += op->cell_w;
+	}
+}
+
+/* コマンドを実行
+ *
+ * x,y,w,h: 描画する範囲。範囲外のピクセルは変更されない。 */
+
+void DrawList_render(DrawList *p,ImageBuf *img,int x,int y,int w,int h)
+{
+	DrawOp *op;
+	_ClipRect clip;
+	int i,ox,oy,ow,oh;
+
+	clip.x1 = x;
+	clip.y1 = y;
+	clip.x2 = x + w;
+	clip.y2 = y + h;
+
+	for(i = p->num, op = p->ops; i > 0; i--, op++)
+	{
+		//範囲外のコマンドは飛ばす
+
+		if(op->x >= clip.x2 || op->y >= clip.y2
+			|| op->x + op->w <= clip.x1 || op->y + op->h <= clip.y1)
+			continue;
+
+		ox = op->x, oy = op->y;
+		ow = op->w, oh = op->h;
+
+		switch(op->type)
+		{
+			case DRAWOP_FILLRECT:
+				if(_clip(&clip, &ox, &oy, &ow, &oh))
+					ImageBuf_fillRect(img, ox, oy, ow, oh, op->col);
+				break;
+			case DRAWOP_BLENDRECT:
+				if(_clip(&clip, &ox, &oy, &ow, &oh))
+					ImageBuf_blendRect(img, ox, oy, ow, oh, op->col);
+				break;
+			case DRAWOP_BOX:
+				_box_clip(img, &clip, ox, oy, ow, oh, op->col);
+				break;
+			case DRAWOP_GLYPHS:
+				_glyphs_clip(p, op, img, &clip);
+				break;
+			case DRAWOP_BLT:
+				if(_clip(&clip, &ox, &oy, &ow, &oh))
+				{
+					ImageBuf_blt(img, ox, oy, op->src,
+						op->sx + ox - op->x, op->sy + oy - op->y, ow, oh);
+				}
+				break;
+		}
+	}
+}
+
+
+//=====================
+// 差分
+//=====================
+
+
+//前後のコマンドを探す数
+#define DIFF_LOOKAHEAD  8
+
+/* コマンドが同じか */
+
+static int _op_equal(DrawList *pa,DrawOp *a,DrawList *pb,DrawOp *b)
+{
+	if(a->type != b->type
+		|| a->x != b->x || a->y != b->y || a->w != b->w || a->h != b->h
+		|| a->col != b->col)
+		return 0;
+
+	switch(a->type)
+	{
+		case DRAWOP_GLYPHS:
+			return (a->len == b->len && a->cell_w == b->cell_w
+				&& a->pad == b->pad && a->underline == b->underline
+				&& memcmp(pa->text + a->text, pb->text + b->text, a->len) == 0);
+		case DRAWOP_BLT:
+			return (a->src == b->src && a->sx == b->sx && a->sy == b->sy);
+	}
+
+	return 1;
+}
+
+/* コマンドの範囲を追加 */
+
+static void _damage_op(DrawDamage *damage,DrawOp *op)
+{
+	DrawDamage_add(damage, op->x, op->y, op->w, op->h);
+}
+
+/* 前のフレームのリストと比較して、更新範囲を追加
+ *
+ * 同じ順序で並ぶ同じコマンドは変化なしとして、それ以外
+ * (追加・削除・変更されたコマンド) の範囲を damage に追加する。
+ * 更新範囲外のピクセルは、前のフレームと同じになる。
+ *
+ * 更新範囲だけを DrawList_render() で描画し直すこと。
+ * 範囲内はすべてのコマンドを描画し直すので、最初のコマンドで
+ * イメージ全体を不透明に塗りつぶしておくこと。
+ * 前のフレームの内容が残っていない場合は使えない。 */
+
+void DrawList_diff(DrawList *p,DrawList *prev,DrawDamage *damage)
+{
+	DrawOp *cur = p->ops,
+		*old = prev->ops;
+	int i,j,k,num,pnum,found;
+
+	num = p->num;
+	pnum = prev->num;
+	i = j = 0;
+
+	while(i < num || j < pnum)
+	{
+		//同じ
+
+		if(i < num && j < pnum && _op_equal(p, cur + i, prev, old + j))
+		{
+			i++, j++;
+			continue;
+		}
+
+		//近くに同じコマンドがあれば、その間を追加/削除されたものとする
+
+		found = 0;
+
+		for(k = 1; k <= DIFF_LOOKAHEAD && !found; k++)
+		{
+			if(i < num && j + k < pnum && _op_equal(p, cur + i, prev, old + j + k))
+			{
+				for(; k > 0; k--, j++)
+					_damage_op(damage, old + j);
+
+				found = 1;
+			}
+			else if(j < pnum && i + k < num && _op_equal(p, cur + i + k, prev, old + j))
+			{
+				for(; k > 0; k--, i++)
+					_damage_op(damage, cur + i);
+
+				found = 1;
+			}
+		}
+
+		//変更された
+
+		if(!found)
+		{
+			if(i < num) _damage_op(damage, cur + i++);
+			if(j < pnum) _damage_op(damage, old + j++);
+		}
+	}
+}
+
+/* 更新範囲を追加
+ *
+ * 重なる範囲があれば結合する。
+ * 最大数を超える場合は、結合して面積の増加が最も少ない範囲と結合する。 */
+
+void DrawDamage_add(DrawDamage *p,int x,int y,int w,int h)
+{
+	DrawRect *rc;
+	int i,x1,y1,x2,y2,add,min,min_no;
+
+	if(w <= 0 || h <= 0) return;
+
+	min = -1;
+	min_no = 0;
+
+	for(i = 0, rc = p->rc; i < p->num; i++, rc++)
+	{
+		x1 = (x < rc->x)? x: rc->x;
+		y1 = (y < rc->y)? y: rc->y;
+		x2 = (x + w > rc->x + rc->w)? x + w: rc->x + rc->w;
+		y2 = (y + h > rc->y + rc->h)? y + h: rc->y + rc->h;
+
+		//重なる場合は結合
+
+		if(x < rc->x + rc->w && x + w > rc->x
+			&& y < rc->y + rc->h && y + h > rc->y)
+		{
+			min_no = i;
+			break;
+		}
+
+		add = (x2 - x1) * (y2 - y1) - rc->w * rc->h;
+
+		if(min < 0 || add < min)
+		{
+			min = add;
+			min_no = i;
+		}
+	}
+
+	//追加
+
+	if(i == p->num && p->num < DRAWDAMAGE_MAX)
+	{
+		rc = p->rc + p->num++;
+
+		rc->x = x, rc->y = y;
+		rc->w = w, rc->h = h;
+		return;
+	}
+
+	//結合
+
+	rc = p->rc + min_no;
+
+	x2 = (x + w > rc->x + rc->w)? x + w: rc->x + rc->w;
+	y2 = (y + h > rc->y + rc->h)? y + h: rc->y + rc->h;
+
+	if(x < rc->x) rc->x = x;
+	if(y < rc->y) rc->y = y;
+
+	rc->w = x2 - rc->x;
+	rc->h = y2 - rc->y;
+}
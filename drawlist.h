@@ -0,0 +1,81 @@
+#ifndef _DRAWLIST_H_
+#define _DRAWLIST_H_
+
+/* 描画コマンドリスト
+ *
+ * ImageBuf への描画を記録しておき、範囲を指定して実行する。
+ * 範囲外は描画されないので、分割して実行しても結果は同じ。
+ *
+ * 前のフレームのリストと比較して、変わったコマンドの範囲を
+ * 更新範囲として取得できる。 */
+
+enum
+{
+	DRAWOP_FILLRECT,
+	DRAWOP_BLENDRECT,
+	DRAWOP_BOX,
+	DRAWOP_GLYPHS,
+	DRAWOP_BLT
+};
+
+typedef struct
+{
+	int type,		//DRAWOP_*
+		x,y,w,h;	//描画される範囲
+	uint32_t col;
+	ImageBuf *src;	//DRAWOP_BLT (描画先とは別のイメージ)
+	int sx,sy,
+		text,		//DRAWOP_GLYPHS: DrawList::text 内の位置
+		len,		//DRAWOP_GLYPHS: バイト数
+		cell_w,		//DRAWOP_GLYPHS: 1文字の幅
+		pad,		//DRAWOP_GLYPHS: セル内の余白
+		underline;	//DRAWOP_GLYPHS: 下線
+}DrawOp;
+
+typedef struct _DrawList DrawList;
+
+struct _DrawList
+{
+	DrawOp *ops;
+	char *text;		//DRAWOP_GLYPHS の文字列
+	int num,
+		alloc,
+		text_len,
+		text_alloc;
+};
+
+/* 更新範囲 */
+
+#define DRAWDAMAGE_MAX  16
+
+typedef struct
+{
+	int x,y,w,h;
+}DrawRect;
+
+typedef struct
+{
+	DrawRect rc[DRAWDAMAGE_MAX];
+	int num;
+}DrawDamage;
+
+
+DrawList *DrawList_new(void);
+void DrawList_destroy(DrawList *p);
+void DrawList_clear(DrawList *p);
+void DrawList_freeBuffer(DrawList *p);
+
+int DrawList_fill(DrawList *p,ImageBuf *img,uint32_t col);
+int DrawList_fillRect(DrawList *p,int x,int y,int w,int h,uint32_t col);
+int DrawList_blendRect(DrawList *p,int x,int y,int w,int h,uint32_t col);
+int DrawList_box(DrawList *p,int x,int y,int w,int h,uint32_t col);
+int DrawList_glyphs(DrawList *p,int x,int y,int cell_w,int cell_h,int pad,
+	const char *text,int len,uint32_t col,int underline);
+int DrawList_blt(DrawList *p,int dx,int dy,ImageBuf *src,int sx,int sy,int w,int h);
+
+void DrawList_render(DrawList *p,ImageBuf *img,int x,int y,int w,int h);
+void DrawList_diff(DrawList *p,DrawList *prev,DrawDamage *damage);
+
+void DrawDamage_add(DrawDamage *p,int x,int y,int w,int h);
+
+#endif
@@ -2,14 +2,19 @@
  * 共有メモリイメージ
  ******************************/
 
+#define _GNU_SOURCE	//fallocate
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <linux/falloc.h>
 
 #include <wayland-client.h>
 
@@ -52,23 +57,24 @@ static int _create_posix_shm(void)
 	return ret;
 }
 
-/* wl_shm_pool 作成 */
+/* 共有メモリを確保してマッピング
+ *
+ * return: fd。失敗時は -1 */
 
-static struct wl_shm_pool *_create_shm_pool(struct wl_shm *shm,int size,void **ppbuf)
+static int _create_shm_data(int size,void **ppbuf)
 {
 	int fd;
 	void *data;
-	struct wl_shm_pool *pool;
 
 	fd = _create_posix_shm();
-	if(fd < 0) return NULL;
+	if(fd < 0) return -1;
 
 	//サイズ変更
 
 	if(ftruncate(fd, size) < 0)
 	{
 		close(fd);
-		return NULL;
+		return -1;
 	}
 
 	//メモリにマッピング
@@ -78,68 +84,641 @@ static struct wl_shm_pool *_create_shm_pool(struct wl_shm *shm,int size,void **p
 	if(data == MAP_FAILED)
 	{
 		close(fd);
-		return NULL;
+		return -1;
 	}
 
-	//wl_shm_pool 作成
+	*ppbuf = data;
 
-	pool = wl_shm_create_pool(shm, fd, size);
+	return fd;
+}
 
-	close(fd);
 
-	*ppbuf = data;
+//=====================
+// ShmArena
+//=====================
+
+
+/* 作成
+ *
+ * size: 初期サイズ。
+ * wl_shm_pool は ShmArena_createPool() で後から作成する。 */
+
+ShmArena *ShmArena_new(int size)
+{
+	ShmArena *p;
+	void *data;
+
+	size = (size + SHM_ARENA_ALIGN - 1) & ~(SHM_ARENA_ALIGN - 1);
+	if(size == 0) size = SHM_ARENA_ALIGN;
+
+	p = (ShmArena *)calloc(1, sizeof(ShmArena));
+	if(!p) return NULL;
+
+	p->fd = _create_posix_shm();
+	if(p->fd < 0) goto ERR;
+
+	if(ftruncate(p->fd, size) < 0) goto ERR;
+
+	//仮想領域を予約してマッピング (サイズを超える部分には触れない)
+
+	data = mmap(NULL, SHM_ARENA_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+	if(data == MAP_FAILED) goto ERR;
+
+	p->data = (uint8_t *)data;
+	p->size = size;
+	p->reserve = SHM_ARENA_RESERVE;
 
-	return pool;
+	return p;
+
+ERR:
+	if(p->fd >= 0) close(p->fd);
+	free(p);
+	return NULL;
+}
+
+/* 削除
+ *
+ * 切り出したイメージは先に削除しておくこと */
+
+void ShmArena_destroy(ShmArena *p)
+{
+	if(p)
+	{
+		if(p->pool)
+			wl_shm_pool_destroy(p->pool);
+
+		munmap(p->data, p->reserve);
+		close(p->fd);
+
+		free(p->blocks);
+		free(p);
+	}
+}
+
+/* wl_shm_pool を作成 (作成済みならサイズを通知)
+ *
+ * return: 0 で成功 */
+
+int ShmArena_createPool(ShmArena *p,struct wl_shm *shm)
+{
+	if(!p->pool)
+	{
+		p->pool = wl_shm_create_pool(shm, p->fd, p->size);
+		if(!p->pool) return -1;
+
+		p->pool_size = p->size;
+	}
+	else if(p->pool_size < p->size)
+	{
+		wl_shm_pool_resize(p->pool, p->size);
+		p->pool_size = p->size;
+	}
+
+	return 0;
+}
+
+/* wl_shm_pool を破棄
+ *
+ * 共有メモリは残るので、ShmArena_createPool() で作り直せる (再接続時) */
+
+void ShmArena_releasePool(ShmArena *p)
+{
+	if(p->pool)
+	{
+		wl_shm_pool_destroy(p->pool);
+		p->pool = NULL;
+		p->pool_size = 0;
+	}
+}
+
+/* ブロック確保
+ *
+ * 使用中のブロックの隙間から最初に収まる所を使う。
+ * なければ終端に追加し、共有メモリを倍々に拡張する。
+ *
+ * return: オフセット。失敗時は -1 */
+
+int ShmArena_alloc(ShmArena *p,int size)
+{
+	ShmBlock *buf;
+	int i,pos,newsize;
+
+	size = (size + SHM_ARENA_ALIGN - 1) & ~(SHM_ARENA_ALIGN - 1);
+
+	//隙間を検索
+
+	pos = 0;
+
+	for(i = 0; i < p->block_num; i++)
+	{
+		if(p->blocks[i].offset - pos >= size) break;
+
+		pos = p->blocks[i].offset + p->blocks[i].size;
+	}
+
+	//拡張
+
+	if(pos + size > p->size)
+	{
+		newsize = p->size * 2;
+
+		while(newsize < pos + size)
+			newsize *= 2;
+
+		if(newsize > p->reserve)
+			newsize = p->reserve;
+
+		if(pos + size > newsize || ftruncate(p->fd, newsize) < 0)
+			return -1;
+
+		p->size = newsize;
+	}
+
+	//ブロック追加 (i の位置に挿入)
+
+	if(p->block_num == p->block_alloc)
+	{
+		newsize = (p->block_alloc)? p->block_alloc * 2: 16;
+
+		buf = (ShmBlock *)realloc(p->blocks, sizeof(ShmBlock) * newsize);
+		if(!buf) return -1;
+
+		p->blocks = buf;
+		p->block_alloc = newsize;
+	}
+
+	memmove(p->blocks + i + 1, p->blocks + i, sizeof(ShmBlock) * (p->block_num - i));
+
+	p->blocks[i].offset = pos;
+	p->blocks[i].size = size;
+	p->block_num++;
+
+	return pos;
+}
+
+/* 共有メモリの範囲の物理メモリを解放
+ *
+ * 範囲はページ単位に内側へ丸める。内容は 0 になる。
+ * return: 解放したバイト数 */
+
+static int _arena_punch(ShmArena *p,int offset,int len)
+{
+	int end;
+
+	end = (offset + len) & ~(SHM_ARENA_ALIGN - 1);
+	offset = (offset + SHM_ARENA_ALIGN - 1) & ~(SHM_ARENA_ALIGN - 1);
+
+	if(end > p->size) end = p->size;
+	if(offset >= end) return 0;
+
+	len = end - offset;
+
+	//穴を開ける (非対応ならマッピングから解放)
+
+	if(fallocate(p->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0
+		&& madvise(p->data + offset, len, MADV_REMOVE) < 0)
+		return 0;
+
+	return len;
+}
+
+/* 未使用の範囲の物理メモリを解放
+ *
+ * ブロック間の隙間と終端を解放する。サイズと仮想領域はそのまま。
+ * 再び確保された時に、0 のページとして割り当てられる。
+ *
+ * return: 解放したバイト数 */
+
+int ShmArena_trim(ShmArena *p)
+{
+	int i,pos,total = 0;
+
+	pos = 0;
+
+	for(i = 0; i < p->block_num; i++)
+	{
+		total += _arena_punch(p, pos, p->blocks[i].offset - pos);
+
+		pos = p->blocks[i].offset + p->blocks[i].size;
+	}
+
+	total += _arena_punch(p, pos, p->size - pos);
+
+	return total;
+}
+
+/* ブロック解放 */
+
+void ShmArena_free(ShmArena *p,int offset)
+{
+	int i;
+
+	for(i = 0; i < p->block_num; i++)
+	{
+		if(p->blocks[i].offset == offset)
+		{
+			p->block_num--;
+
+			memmove(p->blocks + i, p->blocks + i + 1, sizeof(ShmBlock) * (p->block_num - i));
+			break;
+		}
+	}
 }
 
 
 //=====================
+// フォーマットごとの描画関数
+//=====================
+/* 1ピクセルの型と色の変換をマクロで指定して、フォーマットごとに展開する。
+ * ピクセルごとにフォーマットの分岐はしない。
+ *
+ * col は常に 0xAARRGGBB で指定する。 */
 
 
-/* 作成 */
+/* 0xAARRGGBB -> RGB565 */
+#define _COL_TO_565(c)  (uint16_t)((((c) >> 8) & 0xf800) | (((c) >> 5) & 0x07e0) | (((c) >> 3) & 0x001f))
+#define _COL_TO_32(c)   (c)
 
-ImageBuf *ImageBuf_create(struct wl_shm *shm,int width,int height)
+/* 1ピクセルのアルファ合成 (a: 0-255) */
+
+#define _BLEND_CH(d,s,a)  ((d) + ((((s) - (d)) * (a) + 127) / 255))
+
+static inline uint32_t _blend_32(uint32_t dst,uint32_t col,int a)
+{
+	return (dst & 0xff000000)
+		| (_BLEND_CH((int)((dst >> 16) & 255), (int)((col >> 16) & 255), a) << 16)
+		| (_BLEND_CH((int)((dst >> 8) & 255), (int)((col >> 8) & 255), a) << 8)
+		| _BLEND_CH((int)(dst & 255), (int)(col & 255), a);
+}
+
+static inline uint16_t _blend_565(uint16_t dst,uint32_t col,int a)
+{
+	int r,g,b;
+
+	r = _BLEND_CH((dst >> 11) & 31, (int)((col >> 19) & 31), a);
+	g = _BLEND_CH((dst >> 5) & 63, (int)((col >> 10) & 63), a);
+	b = _BLEND_CH(dst & 31, (int)((col >> 3) & 31), a);
+
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+/* 範囲をイメージ内にクリッピング
+ * return: 0 で範囲なし */
+
+static int _clip_rect(ImageBuf *p,int *x,int *y,int *w,int *h)
+{
+	if(*x < 0) { *w += *x; *x = 0; }
+	if(*y < 0) { *h += *y; *y = 0; }
+	if(*x + *w > p->width) *w = p->width - *x;
+	if(*y + *h > p->height) *h = p->height - *y;
+
+	return (*w > 0 && *h > 0);
+}
+
+#define _ROW(p,TYPE,x,y)  ((TYPE *)((uint8_t *)(p)->data + (y) * (p)->pitch) + (x))
+
+#define IMAGEBUF_DEFINE_FUNCS(NAME,TYPE,CONV,BLEND) \
+\
+static void _setPixel_##NAME(ImageBuf *p,int x,int y,uint32_t col) \
+{ \
+	if(x >= 0 && y >= 0 && x < p->width && y < p->height) \
+		*_ROW(p, TYPE, x, y) = CONV(col); \
+} \
+\
+static void _fillRect_##NAME(ImageBuf *p,int x,int y,int w,int h,uint32_t col) \
+{ \
+	TYPE *pd,c = CONV(col); \
+	int i; \
+\
+	if(!_clip_rect(p, &x, &y, &w, &h)) return; \
+\
+	for(; h > 0; h--, y++) \
+	{ \
+		pd = _ROW(p, TYPE, x, y); \
+\
+		for(i = w; i > 0; i--) \
+			*(pd++) = c; \
+	} \
+} \
+\
+static void _blendRect_##NAME(ImageBuf *p,int x,int y,int w,int h,uint32_t col) \
+{ \
+	TYPE *pd; \
+	int i,a = col >> 24; \
+\
+	if(!_clip_rect(p, &x, &y, &w, &h)) return; \
+\
+	for(; h > 0; h--, y++) \
+	{ \
+		pd = _ROW(p, TYPE, x, y); \
+\
+		for(i = w; i > 0; i--, pd++) \
+			*pd = BLEND(*pd, col, a); \
+	} \
+} \
+\
+static const ImageBufFuncs g_funcs_##NAME = { \
+	_setPixel_##NAME, _fillRect_##NAME, _blendRect_##NAME \
+};
+
+IMAGEBUF_DEFINE_FUNCS(32, uint32_t, _COL_TO_32, _blend_32)
+IMAGEBUF_DEFINE_FUNCS(565, uint16_t, _COL_TO_565, _blend_565)
+
+
+/* フォーマットのバイト数 (非対応なら 0) */
+
+int ImageBuf_getFormatBytes(uint32_t format)
+{
+	switch(format)
+	{
+		case WL_SHM_FORMAT_ARGB8888:
+		case WL_SHM_FORMAT_XRGB8888:
+			return 4;
+		case WL_SHM_FORMAT_RGB565:
+			return 2;
+	}
+
+	return 0;
+}
+
+/* RGB (各 8bit) に変換
+ *
+ * dst: width x height x 3 バイト */
+
+void ImageBuf_getRGB(ImageBuf *p,uint8_t *dst)
+{
+	uint32_t c;
+	int x,y,r,g,b;
+
+	for(y = 0; y < p->height; y++)
+	{
+		if(p->bpp == 4)
+		{
+			uint32_t *ps = _ROW(p, uint32_t, 0, y);
+
+			for(x = p->width; x > 0; x--)
+			{
+				c = *(ps++);
+
+				dst[0] = (uint8_t)(c >> 16);
+				dst[1] = (uint8_t)(c >> 8);
+				dst[2] = (uint8_t)c;
+				dst += 3;
+			}
+		}
+		else
+		{
+			uint16_t *ps = _ROW(p, uint16_t, 0, y);
+
+			for(x = p->width; x > 0; x--)
+			{
+				c = *(ps++);
+
+				r = (c >> 11) & 31;
+				g = (c >> 5) & 63;
+				b = c & 31;
+
+				dst[0] = (uint8_t)((r << 3) | (r >> 2));
+				dst[1] = (uint8_t)((g << 2) | (g >> 4));
+				dst[2] = (uint8_t)((b << 3) | (b >> 2));
+				dst += 3;
+			}
+		}
+	}
+}
+
+/* PPM (P6) で保存
+ *
+ * return: 0 で成功 */
+
+int ImageBuf_savePPM(ImageBuf *p,const char *filename)
+{
+	FILE *fp;
+	uint8_t *buf;
+	int size,ret = -1;
+
+	size = p->width * p->height * 3;
+
+	buf = (uint8_t *)malloc(size);
+	if(!buf) return -1;
+
+	ImageBuf_getRGB(p, buf);
+
+	fp = fopen(filename, "wb");
+
+	if(fp)
+	{
+		fprintf(fp, "P6\n%d %d\n255\n", p->width, p->height);
+
+		if(fwrite(buf, 1, size, fp) == size)
+			ret = 0;
+
+		if(fclose(fp)) ret = -1;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+/* フォーマットとサイズをセット */
+
+static void _image_set_format(ImageBuf *p,int width,int height,uint32_t format)
+{
+	p->format = format;
+	p->bpp = ImageBuf_getFormatBytes(format);
+	p->funcs = (p->bpp == 2)? &g_funcs_565: &g_funcs_32;
+	p->width = width;
+	p->height = height;
+	p->pitch = width * p->bpp;
+	p->size = p->pitch * height;
+}
+
+
+//=====================
+// ImageBuf
+//=====================
+
+
+/* 作成 (共有メモリのみ)
+ *
+ * wl_shm がなくても確保・描画できる。
+ * wl_buffer は ImageBuf_createBuffer() で後から作成する。 */
+
+ImageBuf *ImageBuf_new(int width,int height)
 {
 	ImageBuf *img;
-	struct wl_shm_pool *pool;
-	struct wl_buffer *buffer;
 	void *data;
-	int size;
+	int fd;
 
-	size = width * 4 * height;
+	img = (ImageBuf *)calloc(1, sizeof(ImageBuf));
+	if(!img) return NULL;
 
-	//wl_shm_pool 作成
+	_image_set_format(img, width, height, WL_SHM_FORMAT_ARGB8888);
+
+	fd = _create_shm_data(img->size, &data);
+	if(fd < 0)
+	{
+		free(img);
+		return NULL;
+	}
 
-	pool = _create_shm_pool(shm, size, &data);
-	if(!pool) return NULL;
+	img->data = data;
+	img->capacity = img->size;
+	img->fd = fd;
 
-	//wl_buffer 作成
+	return img;
+}
+
+/* 作成 (アリーナから確保)
+ *
+ * format: WL_SHM_FORMAT_ARGB8888/XRGB8888/RGB565
+ *
+ * ImageBuf_new() と同様に、wl_buffer は後から作成する */
+
+ImageBuf *ImageBuf_newArena(ShmArena *arena,int width,int height,uint32_t format)
+{
+	ImageBuf *img;
+	int offset;
+
+	if(!ImageBuf_getFormatBytes(format)) return NULL;
+
+	img = (ImageBuf *)calloc(1, sizeof(ImageBuf));
+	if(!img) return NULL;
+
+	_image_set_format(img, width, height, format);
+
+	offset = ShmArena_alloc(arena, img->size);
+	if(offset < 0)
+	{
+		free(img);
+		return NULL;
+	}
+
+	img->arena = arena;
+	img->data = arena->data + offset;
+	img->capacity = (img->size + SHM_ARENA_ALIGN - 1) & ~(SHM_ARENA_ALIGN - 1);
+	img->offset = offset;
+	img->fd = -1;
+
+	return img;
+}
+
+/* 作成 (通常のメモリ)
+ *
+ * コンポジタなしで描画する場合 (ベンチマークなど)。
+ * 描画関数はそのまま使えるが、wl_buffer は作成できない。 */
+
+ImageBuf *ImageBuf_newMemory(int width,int height,uint32_t format)
+{
+	ImageBuf *img;
+	void *data;
 
-	buffer = wl_shm_pool_create_buffer(pool,
-		0, width, height,
-		width * 4,
-		WL_SHM_FORMAT_ARGB8888);
+	if(!ImageBuf_getFormatBytes(format)) return NULL;
 
-	if(!buffer) goto ERR;
+	img = (ImageBuf *)calloc(1, sizeof(ImageBuf));
+	if(!img) return NULL;
 
-	//ImageBuf 作成
+	_image_set_format(img, width, height, format);
 
-	img = (ImageBuf *)malloc(sizeof(ImageBuf));
-	if(!img) goto ERR;
+	if(posix_memalign(&data, 64, img->size))
+	{
+		free(img);
+		return NULL;
+	}
 
-	img->pool = pool;
-	img->buffer = buffer;
 	img->data = data;
-	img->width = width;
-	img->height = height;
-	img->size = size;
+	img->capacity = img->size;
+	img->fd = -1;
+	img->memory = 1;
 
 	return img;
+}
 
-ERR:
-	wl_shm_pool_destroy(pool);
-	munmap(data, size);
-	return NULL;
+/* wl_shm_pool と wl_buffer を作成
+ *
+ * アリーナの場合は、アリーナの wl_shm_pool から作成する。
+ * return: 0 で成功 */
+
+int ImageBuf_createBuffer(ImageBuf *p,struct wl_shm *shm)
+{
+	if(p->buffer) return 0;
+
+	if(p->memory) return -1;
+
+	if(p->arena)
+	{
+		if(ShmArena_createPool(p->arena, shm)) return -1;
+
+		p->buffer = wl_shm_pool_create_buffer(p->arena->pool,
+			p->offset, p->width, p->height,
+			p->pitch, p->format);
+
+		return (p->buffer)? 0: -1;
+	}
+
+	if(p->fd < 0) return -1;
+
+	//wl_shm_pool 作成
+	//(fd は再接続時に作り直せるように残しておく)
+
+	if(!p->pool)
+	{
+		p->pool = wl_shm_create_pool(shm, p->fd, p->size);
+		if(!p->pool) return -1;
+	}
+
+	//wl_buffer 作成
+
+	p->buffer = wl_shm_pool_create_buffer(p->pool,
+		0, p->width, p->height,
+		p->pitch, p->format);
+
+	if(!p->buffer)
+	{
+		wl_shm_pool_destroy(p->pool);
+		p->pool = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* wl_buffer と wl_shm_pool を破棄
+ *
+ * メモリと内容は残るので、ImageBuf_createBuffer() で作り直せる (再接続時) */
+
+void ImageBuf_releaseBuffer(ImageBuf *p)
+{
+	if(p->buffer)
+	{
+		wl_buffer_destroy(p->buffer);
+		p->buffer = NULL;
+	}
+
+	if(p->pool)
+	{
+		wl_shm_pool_destroy(p->pool);
+		p->pool = NULL;
+	}
+}
+
+/* 作成 */
+
+ImageBuf *ImageBuf_create(struct wl_shm *shm,int width,int height)
+{
+	ImageBuf *img;
+
+	img = ImageBuf_new(width, height);
+	if(!img) return NULL;
+
+	if(ImageBuf_createBuffer(img, shm))
+	{
+		ImageBuf_destroy(img);
+		return NULL;
+	}
+
+	return img;
 }
 
 /* 削除 */
@@ -148,65 +727,199 @@ void ImageBuf_destroy(ImageBuf *p)
 {
 	if(p)
 	{
-		wl_buffer_destroy(p->buffer);
-		wl_shm_pool_destroy(p->pool);
-		munmap(p->data, p->size);
+		ImageBuf_releaseBuffer(p);
+
+		if(p->fd >= 0)
+			close(p->fd);
+
+		if(p->arena)
+			ShmArena_free(p->arena, p->offset);
+		else if(p->memory)
+			free(p->data);
+		else
+			munmap(p->data, p->capacity);
 		
 		free(p);
 	}
 }
 
+/* サイズ変更 (アリーナか通常のメモリのイメージのみ)
+ *
+ * 確保済みのサイズに収まる場合は、同じメモリに wl_buffer だけを作り直す。
+ * 収まらない場合は、倍以上のサイズで確保し直す。
+ * (内容は保持されない)
+ *
+ * return: 0 で成功 */
+
+int ImageBuf_resize(ImageBuf *p,struct wl_shm *shm,int width,int height)
+{
+	void *data;
+	int size,cap,offset;
+
+	if(width == p->width && height == p->height) return 0;
+
+	if(!p->arena && !p->memory) return -1;
+
+	size = width * p->bpp * height;
+
+	//確保し直す
+
+	if(size > p->capacity && p->memory)
+	{
+		cap = p->capacity * 2;
+		if(cap < size) cap = size;
+
+		if(posix_memalign(&data, 64, cap)) return -1;
+
+		free(p->data);
+
+		p->data = data;
+		p->capacity = cap;
+	}
+	else if(size > p->capacity)
+	{
+		cap = p->capacity * 2;
+		if(cap < size) cap = size;
+
+		offset = ShmArena_alloc(p->arena, cap);
+		if(offset < 0) return -1;
+
+		ShmArena_free(p->arena, p->offset);
+
+		p->offset = offset;
+		p->data = p->arena->data + offset;
+		p->capacity = (cap + SHM_ARENA_ALIGN - 1) & ~(SHM_ARENA_ALIGN - 1);
+	}
+
+	_image_set_format(p, width, height, p->format);
+
+	//wl_buffer は作り直す
+
+	if(p->buffer)
+	{
+		wl_buffer_destroy(p->buffer);
+		p->buffer = NULL;
+
+		return ImageBuf_createBuffer(p, shm);
+	}
+
+	return 0;
+}
+
+/* 確保済みで使っていない範囲の物理メモリを解放 (アリーナのみ)
+ *
+ * サイズ変更で大きく確保した分を解放する。
+ * return: 解放したバイト数 */
+
+int ImageBuf_trim(ImageBuf *p)
+{
+	if(!p->arena) return 0;
+
+	return _arena_punch(p->arena, p->offset + p->size, p->capacity - p->size);
+}
+
+/* フォーマットを変更
+ *
+ * ピクセルのバイト数が同じフォーマットのみ (ARGB8888 <-> XRGB8888)。
+ * メモリはそのままで、wl_buffer だけを作り直す。
+ *
+ * return: 0 で成功 */
+
+int ImageBuf_setFormat(ImageBuf *p,struct wl_shm *shm,uint32_t format)
+{
+	if(format == p->format) return 0;
+
+	if(ImageBuf_getFormatBytes(format) != p->bpp) return -1;
+
+	p->format = format;
+
+	if(p->buffer)
+	{
+		wl_buffer_destroy(p->buffer);
+		p->buffer = NULL;
+
+		return ImageBuf_createBuffer(p, shm);
+	}
+
+	return 0;
+}
+
 /* 点を打つ */
 
 void ImageBuf_setPixel(ImageBuf *p,int x,int y,uint32_t col)
 {
-	if(x >= 0 && y >= 0 && x < p->width && y < p->height)
-		*((uint32_t *)p->data + y * p->width + x) = col;
+	(p->funcs->setPixel)(p, x, y, col);
 }
 
 /* 塗りつぶし */
 
 void ImageBuf_fill(ImageBuf *p,uint32_t col)
 {
-	uint32_t *pd = (uint32_t *)p->data;
-	int i;
-
-	for(i = p->width * p->height; i > 0; i--)
-		*(pd++) = col;
+	(p->funcs->fillRect)(p, 0, 0, p->width, p->height, col);
 }
 
 /* 指定位置から指定高さ分塗りつぶし */
 
 void ImageBuf_fillH(ImageBuf *p,int y,int h,uint32_t col)
 {
-	uint32_t *pd;
-	int i;
+	(p->funcs->fillRect)(p, 0, y, p->width, h, col);
+}
 
-	pd = (uint32_t *)p->data + y * p->width;
+/* 四角形塗りつぶし */
 
-	for(i = p->width * h; i > 0; i--)
-		*(pd++) = col;
+void ImageBuf_fillRect(ImageBuf *p,int x,int y,int w,int h,uint32_t col)
+{
+	(p->funcs->fillRect)(p, x, y, w, h, col);
+}
+
+/* 四角形をアルファ合成 (col のアルファ値を使う) */
+
+void ImageBuf_blendRect(ImageBuf *p,int x,int y,int w,int h,uint32_t col)
+{
+	(p->funcs->blendRect)(p, x, y, w, h, col);
 }
 
 /* 四角形枠 */
 
 void ImageBuf_box(ImageBuf *p,int x,int y,int w,int h,uint32_t col)
 {
-	int i,n;
+	if(w <= 0 || h <= 0) return;
 
-	n = y + h - 1;
+	(p->funcs->fillRect)(p, x, y, w, 1, col);
+	(p->funcs->fillRect)(p, x, y + h - 1, w, 1, col);
 
-	for(i = 0; i < w; i++)
-	{
-		ImageBuf_setPixel(p, x + i, y, col);
-		ImageBuf_setPixel(p, x + i, n, col);
-	}
+	(p->funcs->fillRect)(p, x, y + 1, 1, h - 2, col);
+	(p->funcs->fillRect)(p, x + w - 1, y + 1, 1, h - 2, col);
+}
+
+/* イメージをコピー
+ *
+ * 同じフォーマットのみ。範囲はクリッピングされる。 */
+
+void ImageBuf_blt(ImageBuf *dst,int dx,int dy,ImageBuf *src,int sx,int sy,int w,int h)
+{
+	if(dst->format != src->format) return;
+
+	//src の範囲
+
+	if(sx < 0) { w += sx; dx -= sx; sx = 0; }
+	if(sy < 0) { h += sy; dy -= sy; sy = 0; }
+	if(sx + w > src->width) w = src->width - sx;
+	if(sy + h > src->height) h = src->height - sy;
+
+	//dst の範囲
+
+	if(dx < 0) { w += dx; sx -= dx; dx = 0; }
+	if(dy < 0) { h += dy; sy -= dy; dy = 0; }
+	if(dx + w > dst->width) w = dst->width - dx;
+	if(dy + h > dst->height) h = dst->height - dy;
 
-	n = x + w - 1;
+	if(w <= 0 || h <= 0) return;
 
-	for(i = 1; i < h - 1; i++)
+	for(; h > 0; h--, sy++, dy++)
 	{
-		ImageBuf_setPixel(p, x, y + i, col);
-		ImageBuf_setPixel(p, n, y + i, col);
+		memmove((uint8_t *)dst->data + dy * dst->pitch + dx * dst->bpp,
+			(uint8_t *)src->data + sy * src->pitch + sx * src->bpp,
+			w * dst->bpp);
 	}
 }
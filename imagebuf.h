@@ -1,26 +1,97 @@
 #ifndef _IMAGEBUF_H_
 #define _IMAGEBUF_H_
 
+/* 共有メモリアリーナ
+ *
+ * 1つの共有メモリと wl_shm_pool から、複数のイメージを切り出す。
+ * 仮想領域を先に予約しておくので、拡張してもアドレスは変わらない。 */
+
+typedef struct _ShmArena ShmArena;
+
+typedef struct
+{
+	int offset,
+		size;
+}ShmBlock;
+
+struct _ShmArena
+{
+	struct wl_shm_pool *pool;
+	uint8_t *data;		//予約した仮想領域の先頭
+	int fd,
+		size,			//共有メモリのサイズ
+		pool_size,		//wl_shm_pool に通知済みのサイズ
+		reserve;		//予約した仮想領域のサイズ
+
+	ShmBlock *blocks;	//使用中のブロック (オフセット順)
+	int block_num,
+		block_alloc;
+};
+
+#define SHM_ARENA_RESERVE  (256 << 20)
+#define SHM_ARENA_ALIGN    4096
+
+ShmArena *ShmArena_new(int size);
+void ShmArena_destroy(ShmArena *p);
+int ShmArena_createPool(ShmArena *p,struct wl_shm *shm);
+void ShmArena_releasePool(ShmArena *p);
+int ShmArena_alloc(ShmArena *p,int size);
+void ShmArena_free(ShmArena *p,int offset);
+int ShmArena_trim(ShmArena *p);
+
+
 /* 共有メモリイメージ */
 
 typedef struct _ImageBuf ImageBuf;
 
+/* フォーマットごとの描画関数 */
+
+typedef struct
+{
+	void (*setPixel)(ImageBuf *p,int x,int y,uint32_t col);
+	void (*fillRect)(ImageBuf *p,int x,int y,int w,int h,uint32_t col);
+	void (*blendRect)(ImageBuf *p,int x,int y,int w,int h,uint32_t col);
+}ImageBufFuncs;
+
 struct _ImageBuf
 {
-	struct wl_shm_pool *pool;
+	struct wl_shm_pool *pool;	//アリーナから確保した場合は NULL
 	struct wl_buffer *buffer;
+	ShmArena *arena;
+	const ImageBufFuncs *funcs;
 	void *data;
+	uint32_t format;	//WL_SHM_FORMAT_*
 	int width,
 		height,
-		size;
+		bpp,		//1ピクセルのバイト数
+		pitch,		//1行のバイト数
+		size,
+		capacity,	//確保済みのサイズ (size 以上)
+		offset,	//アリーナ内の位置
+		fd,		//共有メモリの fd (アリーナか通常のメモリの場合は -1)
+		memory;	//0 以外で通常のメモリ (wl_buffer は作成できない)
 };
 
+ImageBuf *ImageBuf_new(int width,int height);
+ImageBuf *ImageBuf_newArena(ShmArena *arena,int width,int height,uint32_t format);
+ImageBuf *ImageBuf_newMemory(int width,int height,uint32_t format);
+int ImageBuf_createBuffer(ImageBuf *p,struct wl_shm *shm);
+void ImageBuf_releaseBuffer(ImageBuf *p);
 ImageBuf *ImageBuf_create(struct wl_shm *shm,int width,int height);
 void ImageBuf_destroy(ImageBuf *p);
+int ImageBuf_resize(ImageBuf *p,struct wl_shm *shm,int width,int height);
+int ImageBuf_trim(ImageBuf *p);
+int ImageBuf_setFormat(ImageBuf *p,struct wl_shm *shm,uint32_t format);
+int ImageBuf_getFormatBytes(uint32_t format);
+void ImageBuf_getRGB(ImageBuf *p,uint8_t *dst);
+int ImageBuf_savePPM(ImageBuf *p,const char *filename);
 
 void ImageBuf_setPixel(ImageBuf *p,int x,int y,uint32_t col);
 void ImageBuf_fill(ImageBuf *p,uint32_t col);
 void ImageBuf_fillH(ImageBuf *p,int y,int h,uint32_t col);
+void ImageBuf_fillRect(ImageBuf *p,int x,int y,int w,int h,uint32_t col);
+void ImageBuf_blendRect(ImageBuf *p,int x,int y,int w,int h,uint32_t col);
 void ImageBuf_box(ImageBuf *p,int x,int y,int w,int h,uint32_t col);
+void ImageBuf_blt(ImageBuf *dst,int dx,int dy,ImageBuf *src,int sx,int sy,int w,int h);
 
 #endif
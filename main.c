@@ -2,112 +2,1297 @@
  * text-input-unstable-v3
  ******************************/
 
+#define _GNU_SOURCE	//pipe2
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <linux/input.h>
 
-#include <wayland-client.h>
-#include "text-input-unstable-v3-client-protocol.h"
+#include <wayland-client.h>
+#include "text-input-unstable-v3-client-protocol.h"
+
+#include "client.h"
+#include "imagebuf.h"
+#include "textbuf.h"
+#include "textundo.h"
+#include "memarena.h"
+#include "drawlist.h"
+#include "tilerender.h"
+#include "drawbench.h"
+#include "session.h"
+
+
+//-------------
+
+/* done までの保留状態
+ *
+ * 文字列は arena に複製し、done で適用した後にまとめて捨てる */
+
+typedef struct
+{
+	MemArena *arena;
+	char *preedit,		//NULL でなし
+		*commit;
+	int preedit_begin,
+		preedit_end;
+	uint32_t delete_before,
+		delete_after;
+}TextInputState;
+
+/* seat ごとの入力状態
+ *
+ * Client::seat_size で確保される。
+ * Seat 以外は入力スレッドのハンドラ内で変更される。 */
+
+typedef struct
+{
+	Seat s;
+
+	struct zwp_text_input_v3 *text_input;
+	TextInputState pending;	//done までの保留
+	char *preedit,			//現在の preedit 文字列 (NULL でなし。preedit_buf を指す)
+		*preedit_buf;		//preedit の保持用 (done ごとに使い回す)
+	int preedit_alloc,		//preedit_buf の確保サイズ
+		preedit_cursor,		//preedit 内のカーソル位置 (-1 で非表示)
+		focus;				//text_input の enter 中
+
+	//以下はメインスレッド
+
+	struct wl_data_device *data_device;
+	struct wl_data_offer *selection;	//クリップボードの内容 (NULL でなし)
+	uint32_t mods;						//押されている修飾キー
+}InputSeat;
+
+struct zwp_text_input_manager_v3 *g_input_manager = NULL;
+struct wl_data_device_manager *g_data_device_manager = NULL;
+
+//貼り付け中のパイプ (-1 でなし)
+int g_paste_fd = -1,
+	g_paste_len = 0;
+struct timespec g_paste_time;
+
+/* 以下は入力スレッドのハンドラ内で変更される。
+ * メインスレッドからは Client_input_lock() してアクセスする */
+
+TextBuf *g_text = NULL;
+TextUndo *g_undo = NULL;
+InputSeat *g_undo_seat = NULL;	//最後に確定した seat (seat が変わったら別の単位にする)
+int g_undo_cap = 1024 * 1024;	//アンドゥ履歴の最大サイズ
+struct timespec g_done_time;	//最後の done を受け取った時間
+int g_done_pending = 0;			//done 後、まだコミットしていない
+
+Window *g_win = NULL;
+int g_redraw_fd = -1;			//入力スレッドからの再描画要求 (eventfd)
+
+/* アイドル時のメモリ解放
+ * すべての seat でフォーカスがない状態が続いたら、キャッシュなどを解放する */
+
+int g_idle_fd = -1,		//timerfd
+	g_idle_sec = 30,	//フォーカスがなくなってから解放するまでの秒数 (0 でしない)
+	g_trimmed = 0;		//解放済み (次の描画で作り直す)
+
+struct timespec g_commit_done_time;	//描画中のフレームの done の時間
+int g_commit_done_pending = 0;
+
+//done -> コミットまでの時間 (ms)
+#define LATENCY_NUM 1024
+
+double g_latency[LATENCY_NUM];
+int g_latency_num = 0;
+
+//ウィンドウの描画で、描き直したピクセル数の合計
+double g_damage_px = 0,
+	g_damage_total = 0;
+
+#define INPUTBOX_X 10
+#define INPUTBOX_Y 10
+#define INPUTBOX_W 200
+#define INPUTBOX_H 60
+
+//1文字のセルのサイズ
+#define CHAR_W 10
+#define CHAR_H 16
+
+//入力欄の文字数と行数
+#define INPUTBOX_COLS ((INPUTBOX_W - 4) / CHAR_W)
+#define INPUTBOX_ROWS ((INPUTBOX_H - 4) / CHAR_H)
+
+//セッションファイル (NULL でなし)
+Session *g_session = NULL;
+
+//描画コマンドと、タイル分割の描画 (メインスレッドのみ)
+DrawList *g_list = NULL,
+	*g_list_prev = NULL;	//前回描画したコマンド
+TileRender *g_tiles = NULL;
+
+//前回描画したイメージ (内容が残っているか判定する)
+ImageBuf *g_drawn_img = NULL;
+void *g_drawn_data = NULL;
+int g_drawn_w = 0,
+	g_drawn_h = 0;
+
+//描画時のスケール (120 = 1倍)。座標はサーフェス座標で指定して SC() で変換する
+int g_draw_scale = 120;
+
+#define SC(v)  (((v) * g_draw_scale + 60) / 120)
+
+//seat ごとの preedit の色
+static const uint32_t g_seat_col[4] = {
+	0xff0000ff, 0xff00a000, 0xffa000a0, 0xff008080
+};
+
+//-------------
+
+
+//-----------------------
+// 描画
+//-----------------------
+
+
+/* テキストの配置
+ *
+ * 同じ行・同じ色の連続した文字を1つの DrawList_glyphs() にまとめる。
+ * キャレットは文字列の後に追加する (文字の変更でキャレットの順序が変わらないように)。 */
+
+#define CARET_MAX  8
+
+typedef struct
+{
+	DrawList *list;
+	int x,y,		//次のセルの位置
+		run_x,		//まとめている文字列の位置
+		run_y,
+		run_len,	//まとめている文字列のバイト数 (0 でなし)
+		underline,
+		full,		//入力欄からはみ出た
+		caret_num;
+	uint32_t col;
+	char run[256];
+	int caret[CARET_MAX][2];
+}TextLayout;
+
+/* まとめている文字列を追加 */
+
+static void _layout_flush(TextLayout *p)
+{
+	if(p->run_len)
+	{
+		DrawList_glyphs(p->list, SC(p->run_x), SC(p->run_y),
+			SC(CHAR_W), SC(CHAR_H), SC(1),
+			p->run, p->run_len, p->col, p->underline);
+
+		p->run_len = 0;
+	}
+}
+
+/* 1バイトを追加
+ *
+ * フォントは持たないので、UTF-8 の先頭バイトごとに1セル。
+ * return: 0 以外で入力欄からはみ出た */
+
+static int _layout_char(TextLayout *p,char c,uint32_t col,int underline)
+{
+	if(p->full) return 1;
+
+	//後続バイトは同じ文字
+
+	if((c & 0xc0) == 0x80)
+	{
+		if(p->run_len && p->run_len < sizeof(p->run))
+			p->run[p->run_len++] = c;
+
+		return 0;
+	}
+
+	//改行
+
+	if(c == '\n')
+	{
+		_layout_flush(p);
+
+		p->x = INPUTBOX_X + 2;
+		p->y += CHAR_H;
+
+		if(p->y + CHAR_H > INPUTBOX_Y + INPUTBOX_H - 2)
+			p->full = 1;
+
+		return p->full;
+	}
+
+	//折り返し
+
+	if(p->x + CHAR_W > INPUTBOX_X + INPUTBOX_W - 2)
+	{
+		_layout_flush(p);
+
+		p->x = INPUTBOX_X + 2;
+		p->y += CHAR_H;
+	}
+
+	if(p->y + CHAR_H > INPUTBOX_Y + INPUTBOX_H - 2)
+	{
+		_layout_flush(p);
+		p->full = 1;
+		return 1;
+	}
+
+	//色が変わるか、いっぱいなら区切る
+
+	if(p->run_len
+		&& (col != p->col || underline != p->underline || p->run_len + 4 > sizeof(p->run)))
+		_layout_flush(p);
+
+	if(!p->run_len)
+	{
+		p->run_x = p->x;
+		p->run_y = p->y;
+		p->col = col;
+		p->underline = underline;
+	}
+
+	p->run[p->run_len++] = c;
+	p->x += CHAR_W;
+
+	return 0;
+}
+
+/* 現在位置にキャレット */
+
+static void _layout_caret(TextLayout *p)
+{
+	if(!p->full && p->caret_num < CARET_MAX)
+	{
+		p->caret[p->caret_num][0] = p->x;
+		p->caret[p->caret_num][1] = p->y;
+		p->caret_num++;
+	}
+}
+
+/* テキスト描画
+ *
+ * UTF-8 の1文字を1セルとする */
+
+static void _draw_text(Client *p,DrawList *list)
+{
+	InputSeat *st;
+	TextLayout lay;
+	int i,len,cursor,c,n;
+
+	memset(&lay, 0, sizeof(TextLayout));
+
+	lay.list = list;
+	lay.x = INPUTBOX_X + 2;
+	lay.y = INPUTBOX_Y + 2;
+
+	len = TextBuf_getLength(g_text);
+	cursor = TextBuf_getCursor(g_text);
+
+	for(i = 0; i <= len; i++)
+	{
+		//カーソル位置に preedit
+
+		if(i == cursor)
+		{
+			_layout_caret(&lay);
+
+			//各 seat の preedit を順に並べる
+
+			for(n = 0; n < p->seat_num; n++)
+			{
+				st = (InputSeat *)p->seats[n];
+
+				if(!st->preedit) continue;
+
+				for(c = 0; st->preedit[c]; c++)
+				{
+					if(c == st->preedit_cursor)
+						_layout_caret(&lay);
+
+					_layout_char(&lay, st->preedit[c], g_seat_col[n & 3], 1);
+				}
+
+				if(c == st->preedit_cursor)
+					_layout_caret(&lay);
+			}
+		}
+
+		if(i == len || _layout_char(&lay, TextBuf_getChar(g_text, i), 0xff000000, 0))
+			break;
+	}
+
+	_layout_flush(&lay);
+
+	//キャレット
+
+	for(i = 0; i < lay.caret_num; i++)
+	{
+		DrawList_box(list, SC(lay.caret[i][0]), SC(lay.caret[i][1]),
+			SC(1), SC(CHAR_H), 0xff000000);
+	}
+}
+
+/* ウィンドウ全体の描画コマンドを作成 */
+
+static void _draw_list(Client *p,DrawList *list,ImageBuf *img)
+{
+	DrawList_clear(list);
+
+	DrawList_fill(list, img, 0xffff0000);
+
+	DrawList_box(list,
+		SC(INPUTBOX_X), SC(INPUTBOX_Y), SC(INPUTBOX_W), SC(INPUTBOX_H),
+		0xff000000);
+
+	if(g_text)
+		_draw_text(p, list);
+}
+
+/* 描画
+ *
+ * 前回と同じイメージに描画する場合は、前回の描画コマンドと比較して
+ * 変わった範囲だけを描画し直し、win があれば更新範囲として追加する。
+ * 大きい範囲はタイルに分けて、複数スレッドで描画される。 */
+
+static void _draw(Client *p,ImageBuf *img,Window *win)
+{
+	DrawList *tmp;
+	DrawDamage damage;
+	int i;
+
+	//アイドル時に解放されていれば作り直す
+
+	if(!g_tiles)
+		g_tiles = TileRender_new(0);
+
+	_draw_list(p, g_list, img);
+
+	//前回と内容が続いていなければ全体
+
+	if(img != g_drawn_img || img->data != g_drawn_data
+		|| img->width != g_drawn_w || img->height != g_drawn_h)
+	{
+		damage.num = 1;
+		damage.rc[0].x = damage.rc[0].y = 0;
+		damage.rc[0].w = img->width;
+		damage.rc[0].h = img->height;
+
+		g_drawn_img = img;
+		g_drawn_data = img->data;
+		g_drawn_w = img->width;
+		g_drawn_h = img->height;
+	}
+	else
+	{
+		damage.num = 0;
+
+		DrawList_diff(g_list, g_list_prev, &damage);
+	}
+
+	//描画
+
+	if(win) Window_beginDamage(win);
+
+	for(i = 0; i < damage.num; i++)
+	{
+		if(g_tiles)
+		{
+			TileRender_run(g_tiles, g_list, img,
+				damage.rc[i].x, damage.rc[i].y, damage.rc[i].w, damage.rc[i].h);
+		}
+		else
+		{
+			DrawList_render(g_list, img,
+				damage.rc[i].x, damage.rc[i].y, damage.rc[i].w, damage.rc[i].h);
+		}
+
+		if(win)
+		{
+			Window_addDamage(win,
+				damage.rc[i].x, damage.rc[i].y, damage.rc[i].w, damage.rc[i].h);
+
+			g_damage_px += (double)damage.rc[i].w * damage.rc[i].h;
+		}
+	}
+
+	if(win)
+		g_damage_total += (double)img->width * img->height;
+
+	//今回のリストを次回の比較用に
+
+	tmp = g_list_prev;
+	g_list_prev = g_list;
+	g_list = tmp;
+}
+
+
+//-----------------------
+// 遅延の計測
+//-----------------------
+
+
+static int _cmp_double(const void *a,const void *b)
+{
+	double d = *(const double *)a - *(const double *)b;
+
+	return (d < 0)? -1: (d > 0);
+}
+
+/* done -> コミットの時間を記録 */
+
+static void _latency_add(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	g_latency[g_latency_num % LATENCY_NUM] =
+		(now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+
+	g_latency_num++;
+}
+
+/* 結果を出力 */
+
+static void _latency_report(void)
+{
+	int num;
+
+	num = (g_latency_num < LATENCY_NUM)? g_latency_num: LATENCY_NUM;
+	if(num == 0) return;
+
+	qsort(g_latency, num, sizeof(double), _cmp_double);
+
+	fprintf(stderr, "done -> commit: %d samples, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		num, g_latency[num / 2], g_latency[num * 99 / 100], g_latency[num - 1]);
+
+	if(g_damage_total > 0)
+		fprintf(stderr, "redrawn: %.2f%% of window pixels\n", g_damage_px * 100 / g_damage_total);
+}
+
+/* タイル分割描画の計測 (--bench-tiles)
+ *
+ * 4K のイメージ全体を、1 から CPU 数までのスレッド数で描画して、
+ * 1フレームの時間と、1スレッドで順に描画した結果と同じかを出力する。 */
+
+#define BENCH_W      3840
+#define BENCH_H      2160
+#define BENCH_FRAMES 30
+
+static double _time_ms(const struct timespec *a,const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000.0 + (b->tv_nsec - a->tv_nsec) / 1000000.0;
+}
+
+static void _bench_tiles(Client *p)
+{
+	ImageBuf *ref,*img;
+	TileRender *tiles;
+	struct timespec t1,t2;
+	double ms,ms1 = 0;
+	int i,n,cpu;
+
+	ref = ImageBuf_newMemory(BENCH_W, BENCH_H, WL_SHM_FORMAT_ARGB8888);
+	img = ImageBuf_newMemory(BENCH_W, BENCH_H, WL_SHM_FORMAT_ARGB8888);
+
+	if(!ref || !img) goto END;
+
+	//入力欄がイメージ全体になるスケールで、文字を埋める
+
+	g_draw_scale = BENCH_W * 120 / (INPUTBOX_X * 2 + INPUTBOX_W);
+
+	for(i = 0; i < 200; i++)
+		TextBuf_insert(g_text, "a", 1);
+
+	_draw_list(p, g_list, ref);
+
+	DrawList_render(g_list, ref, 0, 0, BENCH_W, BENCH_H);
+
+	//
+
+	cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cpu < 1) cpu = 1;
+
+	for(n = 1; n <= cpu; n++)
+	{
+		tiles = TileRender_new(n);
+		if(!tiles) break;
+
+		memset(img->data, 0, img->size);
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		for(i = 0; i < BENCH_FRAMES; i++)
+			TileRender_run(tiles, g_list, img, 0, 0, BENCH_W, BENCH_H);
+
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		ms = _time_ms(&t1, &t2) / BENCH_FRAMES;
+		if(n == 1) ms1 = ms;
+
+		printf("threads %2d: %8.3f ms/frame, x%.2f, %s\n",
+			tiles->thread_num, ms, ms1 / ms,
+			memcmp(ref->data, img->data, ref->size)? "MISMATCH": "identical");
+
+		TileRender_destroy(tiles);
+	}
+
+END:
+	ImageBuf_destroy(ref);
+	ImageBuf_destroy(img);
+}
+
+
+//-----------------------
+// セッションファイル
+//-----------------------
+
+
+/* セッションファイルを開いて、テキストを復元
+ *
+ * 復元できた場合は g_text を置き換える */
+
+static void _session_open(const char *filename)
+{
+	TextBuf *tb;
+	struct timespec t1,t2;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	g_session = Session_open(filename);
+
+	if(!g_session)
+	{
+		printf("[!] failed to open session '%s'\n", filename);
+		return;
+	}
+
+	tb = Session_restore(g_session, INPUTBOX_COLS, INPUTBOX_ROWS);
+
+	if(tb)
+	{
+		TextBuf_destroy(g_text);
+		g_text = tb;
+
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		printf("session: restored %d bytes in %.3f ms\n",
+			TextBuf_getLength(tb), _time_ms(&t1, &t2));
+	}
+}
+
+/* 最後の変更を書き込んで閉じる */
+
+static void _session_close(void)
+{
+	if(g_session)
+	{
+		Session_update(g_session, g_text, INPUTBOX_COLS);
+		Session_close(g_session);
+		g_session = NULL;
+	}
+}
+
+
+//-----------------------
+// アイドル時のメモリ解放
+//-----------------------
+
+
+/* フォーカスが変わった時
+ *
+ * 入力スレッドで、ロックした状態で呼ばれる。
+ * すべての seat でフォーカスがなければタイマーを開始、あれば停止する。 */
+
+static void _idle_update(Client *p)
+{
+	struct itimerspec ts;
+	int i;
+
+	if(g_idle_fd < 0) return;
+
+	memset(&ts, 0, sizeof(ts));
+
+	for(i = 0; i < p->seat_num; i++)
+	{
+		if(((InputSeat *)p->seats[i])->focus) break;
+	}
+
+	if(i == p->seat_num)
+		ts.it_value.tv_sec = g_idle_sec;
+
+	timerfd_settime(g_idle_fd, 0, &ts, NULL);
+}
+
+/* 解放
+ *
+ * 描画コマンドのバッファ、タイル描画のスレッド、
+ * 共有メモリの未使用範囲の物理メモリを解放する。
+ * 表示中のイメージはそのまま。次の描画時に全体を描き直す。 */
+
+static void _idle_trim(Client *p)
+{
+	int size;
+
+	DrawList_freeBuffer(g_list);
+	DrawList_freeBuffer(g_list_prev);
+
+	TileRender_destroy(g_tiles);
+	g_tiles = NULL;
+
+	g_drawn_img = NULL;
+
+	size = Client_trim(p);
+
+	g_trimmed = 1;
+
+	printf("idle: trimmed, %d KB of shm released\n", size / 1024);
+}
+
+/* タイマー (メインスレッド) */
+
+static void _idle_handle(Client *p,int fd,int events)
+{
+	uint64_t val;
+	int i;
+
+	if(read(fd, &val, sizeof(val)) < 0)
+		return;
+
+	Client_input_lock(p);
+
+	//その間にフォーカスを得ていないか
+
+	for(i = 0; i < p->seat_num; i++)
+	{
+		if(((InputSeat *)p->seats[i])->focus) break;
+	}
+
+	if(i == p->seat_num && !g_trimmed)
+		_idle_trim(p);
+
+	Client_input_unlock(p);
+}
+
+
+//-----------------------
+// zwp_text_input_v3
+//-----------------------
+/* ハンドラは入力スレッドで実行される */
+
+
+/* 保留状態をクリア
+ *
+ * arena はブロックを残したままリセットするので、
+ * 次の done までの入力で malloc() は行われない */
+
+static void _pending_clear(TextInputState *p)
+{
+	if(p->arena)
+		MemArena_reset(p->arena);
+
+	p->preedit = p->commit = NULL;
+	p->preedit_begin = p->preedit_end = 0;
+	p->delete_before = p->delete_after = 0;
+}
+
+/* preedit を seat のバッファに保持
+ *
+ * 保留中の文字列は done 後に捨てられるので、コピーする
+ * return: 0 で成功 */
+
+static int _seat_set_preedit(InputSeat *st,const char *text)
+{
+	char *buf;
+	int len,n;
+
+	len = strlen(text) + 1;
+
+	if(len > st->preedit_alloc)
+	{
+		n = (st->preedit_alloc)? st->preedit_alloc: 64;
+
+		while(n < len)
+			n *= 2;
+
+		buf = (char *)realloc(st->preedit_buf, n);
+		if(!buf) return -1;
+
+		st->preedit_buf = buf;
+		st->preedit_alloc = n;
+	}
+
+	memcpy(st->preedit_buf, text, len);
+
+	st->preedit = st->preedit_buf;
+
+	return 0;
+}
+
+/* done 時、保留状態を適用 */
+
+static void _pending_apply(InputSeat *st)
+{
+	TextInputState *p = &st->pending;
+
+	/* アンドゥ単位
+	 * preedit の入力中 (変換中) に続けて確定された分は、1つにまとめる */
+
+	if(!st->preedit || st != g_undo_seat)
+		TextUndo_begin(g_undo);
+
+	g_undo_seat = st;
+
+	//preedit はテキストに含めていないので、置き換えるだけ
+
+	st->preedit = NULL;
+	st->preedit_cursor = -1;
+
+	//周囲のテキストを削除
+
+	if(p->delete_before || p->delete_after)
+		TextUndo_deleteSurrounding(g_undo, g_text, p->delete_before, p->delete_after);
+
+	//確定文字列を挿入
+
+	if(p->commit)
+		TextUndo_insert(g_undo, g_text, p->commit, strlen(p->commit));
+
+	//preedit
+
+	if(p->preedit && _seat_set_preedit(st, p->preedit) == 0)
+		st->preedit_cursor = p->preedit_begin;
+
+	_pending_clear(p);
+}
+
+/* enter */
+
+static void _input_enter(void *data, struct zwp_text_input_v3 *text_input,
+	struct wl_surface *surface)
+{
+	InputSeat *st = (InputSeat *)data;
+
+	printf("text_input # enter | seat:%d\n", st->s.index);
+
+	st->focus = 1;
+
+	_idle_update(st->s.client);
+
+	zwp_text_input_v3_enable(text_input);
+
+	zwp_text_input_v3_set_cursor_rectangle(text_input,
+		INPUTBOX_X, INPUTBOX_Y, INPUTBOX_W, INPUTBOX_H);
+
+	zwp_text_input_v3_commit(text_input);
+}
+
+/* leave */
+
+static void _input_leave(void *data, struct zwp_text_input_v3 *text_input,
+	struct wl_surface *surface)
+{
+	InputSeat *st = (InputSeat *)data;
+
+	printf("text_input # leave | seat:%d\n", st->s.index);
+
+	st->focus = 0;
+
+	_idle_update(st->s.client);
+
+	zwp_text_input_v3_disable(text_input);
+	zwp_text_input_v3_commit(text_input);
+}
+
+/* preedit_string */
+
+static void _input_preedit_string(void *data, struct zwp_text_input_v3 *text_input,
+	const char *text, int32_t cursor_begin, int32_t cursor_end)
+{
+	TextInputState *p = &((InputSeat *)data)->pending;
+
+	printf("text_input # preedit_string | text:\"%s\", cursor_begin:%d, cursor_end:%d\n",
+		text, cursor_begin, cursor_end);
+
+	//同じ done 内で再度送られた場合、前の分は arena に残る (done 後に捨てる)
+
+	p->preedit = (text)? MemArena_strdup(p->arena, text): NULL;
+	p->preedit_begin = cursor_begin;
+	p->preedit_end = cursor_end;
+}
+
+/* commit_string */
+
+static void _input_commit_string(void *data, struct zwp_text_input_v3 *text_input,
+	const char *text)
+{
+	TextInputState *p = &((InputSeat *)data)->pending;
+
+	printf("text_input # commit_string | text:\"%s\"\n", text);
+
+	p->commit = (text)? MemArena_strdup(p->arena, text): NULL;
+}
+
+/* delete_surrounding_text */
+
+static void _input_delete_surrounding_text(void *data,
+	struct zwp_text_input_v3 *text_input,
+	uint32_t before_length, uint32_t after_length)
+{
+	TextInputState *p = &((InputSeat *)data)->pending;
+
+	printf("text_input # delete_surrounding_text | before_length:%u, after_length:%u\n",
+		before_length, after_length);
+
+	p->delete_before = before_length;
+	p->delete_after = after_length;
+}
+
+/* done */
+
+static void _input_done(void *data, struct zwp_text_input_v3 *text_input,
+	uint32_t serial)
+{
+	uint64_t val = 1;
+
+	printf("text_input # done | serial:%u\n", serial);
+
+	_pending_apply((InputSeat *)data);
+
+	//メインスレッドで再描画
+
+	if(!g_done_pending)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &g_done_time);
+		g_done_pending = 1;
+	}
+
+	if(write(g_redraw_fd, &val, sizeof(val)) < 0)
+		perror("write");
+
+#if 0
+	//周囲のテキストセット
+	
+	zwp_text_input_v3_set_surrounding_text(text_input,
+		"[text]", 1, 5);
+
+	zwp_text_input_v3_set_text_change_cause(text_input,
+		ZWP_TEXT_INPUT_V3_CHANGE_CAUSE_INPUT_METHOD);
+
+	zwp_text_input_v3_commit(text_input);
+#endif
+}
+
+
+static const struct zwp_text_input_v3_listener g_text_input_listener = {
+	_input_enter, _input_leave, _input_preedit_string,
+	_input_commit_string, _input_delete_surrounding_text, _input_done
+};
+
+
+//-----------------------
+// 再描画 (メインスレッド)
+//-----------------------
+
+
+/* 入力スレッドからの再描画要求 */
+
+static void _redraw_handle(Client *p,int fd,int events)
+{
+	uint64_t val;
+
+	if(read(fd, &val, sizeof(val)) < 0)
+		return;
+
+	Window_setDirty(g_win);
+}
+
+/* Window::draw */
+
+static void _window_draw(Window *win)
+{
+	Client *p = win->client;
+
+	//入力スレッドが状態を変更しないように、描画中はロック
+
+	struct timespec t1,t2;
+
+	Client_input_lock(p);
+
+	g_draw_scale = win->render_scale120;
+
+	//アイドル時の解放後は、作り直しの時間を計測
+
+	if(g_trimmed)
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	_draw(p, win->img, win);
+
+	//done などでテキストが変わっていれば、セッションファイルへ差分を書き込む
+
+	if(g_session)
+		Session_update(g_session, g_text, INPUTBOX_COLS);
+
+	if(g_trimmed)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		printf("idle: rebuilt in %.3f ms\n", _time_ms(&t1, &t2));
+
+		g_trimmed = 0;
+	}
+
+	g_commit_done_time = g_done_time;
+	g_commit_done_pending = g_done_pending;
+	g_done_pending = 0;
+
+	Client_input_unlock(p);
+}
+
+/* Window::updated */
+
+static void _window_updated(Window *win)
+{
+	if(g_commit_done_pending)
+		_latency_add(&g_commit_done_time);
+}
+
+
+//-----------------------
+// クリップボード
+//-----------------------
+
+
+#define PASTE_MIME  "text/plain;charset=utf-8"
+
+//1回の read() と、1回の poll で読み込む最大サイズ
+#define PASTE_READ_SIZE  (64 * 1024)
+#define PASTE_READ_MAX   (256 * 1024)
+
+//修飾キー (キーマップは読み込まないので、標準の xkb の割り当て)
+#define MOD_MASK_SHIFT    (1 << 0)
+#define MOD_MASK_CONTROL  (1 << 2)
+
+
+/* wl_data_offer */
+
+static void _offer_offer(void *data, struct wl_data_offer *offer, const char *mime_type)
+{
+	//UTF-8 のテキストがあれば、ユーザーデータを 1 にする
+
+	if(strcmp(mime_type, PASTE_MIME) == 0)
+		wl_data_offer_set_user_data(offer, (void *)1);
+}
+
+static void _offer_source_actions(void *data, struct wl_data_offer *offer, uint32_t source_actions)
+{
+}
+
+static void _offer_action(void *data, struct wl_data_offer *offer, uint32_t dnd_action)
+{
+}
+
+static const struct wl_data_offer_listener g_data_offer_listener = {
+	.offer = _offer_offer,
+	.source_actions = _offer_source_actions,
+	.action = _offer_action
+};
+
+/* wl_data_device */
+
+static void _data_device_data_offer(void *data, struct wl_data_device *device,
+	struct wl_data_offer *offer)
+{
+	wl_data_offer_add_listener(offer, &g_data_offer_listener, NULL);
+}
+
+static void _data_device_enter(void *data, struct wl_data_device *device,
+	uint32_t serial, struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y,
+	struct wl_data_offer *offer)
+{
+	//ドラッグ&ドロップは受け付けない
+
+	if(offer)
+		wl_data_offer_destroy(offer);
+}
+
+static void _data_device_leave(void *data, struct wl_data_device *device)
+{
+}
+
+static void _data_device_motion(void *data, struct wl_data_device *device,
+	uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+}
+
+static void _data_device_drop(void *data, struct wl_data_device *device)
+{
+}
+
+/* クリップボードの内容が変わった */
+
+static void _data_device_selection(void *data, struct wl_data_device *device,
+	struct wl_data_offer *offer)
+{
+	InputSeat *st = (InputSeat *)data;
+
+	if(st->selection && st->selection != offer)
+		wl_data_offer_destroy(st->selection);
+
+	st->selection = offer;
+}
+
+static const struct wl_data_device_listener g_data_device_listener = {
+	.data_offer = _data_device_data_offer,
+	.enter = _data_device_enter,
+	.leave = _data_device_leave,
+	.motion = _data_device_motion,
+	.drop = _data_device_drop,
+	.selection = _data_device_selection
+};
+
+/* seat の wl_data_device を作成 */
+
+static void _seat_create_data_device(InputSeat *st)
+{
+	if(!g_data_device_manager || st->data_device) return;
+
+	st->data_device = wl_data_device_manager_get_data_device(g_data_device_manager, st->s.seat);
+
+	if(st->data_device)
+		wl_data_device_add_listener(st->data_device, &g_data_device_listener, st);
+}
+
+/* seat の wl_data_device を削除 */
+
+static void _seat_destroy_data_device(InputSeat *st)
+{
+	if(st->selection)
+	{
+		wl_data_offer_destroy(st->selection);
+		st->selection = NULL;
+	}
+
+	if(st->data_device)
+	{
+		if(wl_data_device_get_version(st->data_device) >= WL_DATA_DEVICE_RELEASE_SINCE_VERSION)
+			wl_data_device_release(st->data_device);
+		else
+			wl_data_device_destroy(st->data_device);
+
+		st->data_device = NULL;
+	}
+}
+
+/* wl_data_device_manager */
+
+static int _data_device_manager_bind(Client *p,void *proxy,uint32_t ver)
+{
+	int i;
 
-#include "client.h"
-#include "imagebuf.h"
+	if(g_data_device_manager) return 1;
 
+	g_data_device_manager = (struct wl_data_device_manager *)proxy;
 
-//-------------
+	for(i = 0; i < p->seat_num; i++)
+		_seat_create_data_device((InputSeat *)p->seats[i]);
 
-struct zwp_text_input_manager_v3 *g_input_manager = NULL;
-struct zwp_text_input_v3 *g_text_input;
+	return 0;
+}
 
-#define INPUTBOX_X 10
-#define INPUTBOX_Y 10
-#define INPUTBOX_W 200
-#define INPUTBOX_H 60
+static void _data_device_manager_remove(Client *p,void *proxy)
+{
+	int i;
 
-//-------------
+	for(i = 0; i < p->seat_num; i++)
+		_seat_destroy_data_device((InputSeat *)p->seats[i]);
+
+	wl_data_device_manager_destroy(g_data_device_manager);
+	g_data_device_manager = NULL;
+}
 
+static const ClientGlobal g_global_data_device_manager = {
+	&wl_data_device_manager_interface, 1, 3,
+	_data_device_manager_bind, _data_device_manager_remove
+};
 
-//-----------------------
-// zwp_text_input_v3
-//-----------------------
+/* 貼り付けのデータを読み込む (poll)
+ *
+ * パイプからテキストのギャップへ直接読み込む。
+ * 大きいデータでもループが止まらないように、1回の読み込み量は制限する。 */
 
+static void _paste_handle(Client *p,int fd,int events)
+{
+	struct timespec now;
+	int ret = -1,total = 0;
 
-/* enter */
+	Client_input_lock(p);
 
-static void _input_enter(void *data, struct zwp_text_input_v3 *text_input,
-	struct wl_surface *surface)
+	while(total < PASTE_READ_MAX)
+	{
+		ret = TextBuf_readFd(g_text, fd, PASTE_READ_SIZE);
+		if(ret <= 0) break;
+
+		TextUndo_addInserted(g_undo, g_text, ret);
+
+		total += ret;
+	}
+
+	Client_input_unlock(p);
+
+	g_paste_len += total;
+
+	if(total && g_win)
+		Window_setDirty(g_win);
+
+	//終了
+
+	if(ret == 0 || (ret < 0 && errno != EAGAIN))
+	{
+		Client_poll_delete(p, fd);
+		g_paste_fd = -1;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		printf("paste: %d bytes, %.3f ms\n", g_paste_len, _time_ms(&g_paste_time, &now));
+	}
+}
+
+/* 貼り付けを開始
+ *
+ * 受け取り側のパイプを poll に追加して、データが来るたびに読み込む */
+
+static void _paste_start(Client *p,InputSeat *st)
 {
-	printf("text_input # enter\n");
+	int fds[2];
 
-	zwp_text_input_v3_enable(text_input);
+	if(g_paste_fd >= 0
+		|| !st->selection
+		|| !wl_data_offer_get_user_data(st->selection))
+		return;
 
-	zwp_text_input_v3_set_cursor_rectangle(text_input,
-		INPUTBOX_X, INPUTBOX_Y, INPUTBOX_W, INPUTBOX_H);
+	if(pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+		return;
 
-	zwp_text_input_v3_commit(text_input);
+	wl_data_offer_receive(st->selection, PASTE_MIME, fds[1]);
+	close(fds[1]);
+
+	g_paste_fd = fds[0];
+	g_paste_len = 0;
+
+	//貼り付け全体で1つのアンドゥ単位
+
+	Client_input_lock(p);
+	TextUndo_begin(g_undo);
+	g_undo_seat = NULL;
+	Client_input_unlock(p);
+
+	clock_gettime(CLOCK_MONOTONIC, &g_paste_time);
+
+	Client_poll_add(p, fds[0], POLLIN, _paste_handle);
 }
 
-/* leave */
 
-static void _input_leave(void *data, struct zwp_text_input_v3 *text_input,
-	struct wl_surface *surface)
+/* アンドゥ/リドゥ
+ *
+ * 貼り付け中は行わない */
+
+static void _undo_redo(Client *p,int redo)
 {
-	printf("text_input # leave\n");
+	int ret;
 
-	zwp_text_input_v3_disable(text_input);
-	zwp_text_input_v3_commit(text_input);
+	if(g_paste_fd >= 0) return;
+
+	Client_input_lock(p);
+
+	if(redo)
+		ret = TextUndo_redo(g_undo, g_text);
+	else
+		ret = TextUndo_undo(g_undo, g_text);
+
+	Client_input_unlock(p);
+
+	if(ret == 0 && g_win)
+		Window_setDirty(g_win);
 }
 
-/* preedit_string */
 
-static void _input_preedit_string(void *data, struct zwp_text_input_v3 *text_input,
-	const char *text, int32_t cursor_begin, int32_t cursor_end)
+//-----------------------
+// wl_pointer
+//-----------------------
+
+
+/* ウィンドウに入った時、I ビームのカーソルにする */
+
+static void _pointer_enter(void *data, struct wl_pointer *pointer,
+	uint32_t serial, struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y)
 {
-	printf("text_input # preedit_string | text:\"%s\", cursor_begin:%d, cursor_end:%d\n",
-		text, cursor_begin, cursor_end);
+	Seat *seat = (Seat *)data;
+
+	Client_set_cursor(seat->client, seat, serial, surface, "xterm");
 }
 
-/* commit_string */
+static void _pointer_leave(void *data, struct wl_pointer *pointer,
+	uint32_t serial, struct wl_surface *surface)
+{
+	Seat *seat = (Seat *)data;
 
-static void _input_commit_string(void *data, struct zwp_text_input_v3 *text_input,
-	const char *text)
+	Client_unset_cursor(seat->client, seat);
+}
+
+static void _pointer_motion(void *data, struct wl_pointer *pointer,
+	uint32_t time, wl_fixed_t x, wl_fixed_t y)
 {
-	printf("text_input # commit_string | text:\"%s\"\n", text);
+
 }
 
-/* delete_surrounding_text */
+static void _pointer_button(void *data, struct wl_pointer *pointer,
+	uint32_t serial, uint32_t time, uint32_t button, uint32_t state)
+{
 
-static void _input_delete_surrounding_text(void *data,
-	struct zwp_text_input_v3 *text_input,
-	uint32_t before_length, uint32_t after_length)
+}
+
+static void _pointer_axis(void *data, struct wl_pointer *pointer,
+	uint32_t time, uint32_t axis, wl_fixed_t value)
 {
-	printf("text_input # delete_surrounding_text | before_length:%u, after_length:%u\n",
-		before_length, after_length);
+
 }
 
-/* done */
+static void _pointer_frame(void *data, struct wl_pointer *pointer)
+{
 
-static void _input_done(void *data, struct zwp_text_input_v3 *text_input,
-	uint32_t serial)
+}
+
+static void _pointer_axis_source(void *data, struct wl_pointer *pointer, uint32_t axis_source)
 {
-	printf("text_input # done | serial:%u\n", serial);
 
-#if 0
-	//周囲のテキストセット
-	
-	zwp_text_input_v3_set_surrounding_text(text_input,
-		"[text]", 1, 5);
+}
 
-	zwp_text_input_v3_set_text_change_cause(text_input,
-		ZWP_TEXT_INPUT_V3_CHANGE_CAUSE_INPUT_METHOD);
+static void _pointer_axis_stop(void *data, struct wl_pointer *pointer,
+	uint32_t time, uint32_t axis)
+{
 
-	zwp_text_input_v3_commit(text_input);
-#endif
 }
 
+static void _pointer_axis_discrete(void *data, struct wl_pointer *pointer,
+	uint32_t axis, int32_t discrete)
+{
 
-static const struct zwp_text_input_v3_listener g_text_input_listener = {
-	_input_enter, _input_leave, _input_preedit_string,
-	_input_commit_string, _input_delete_surrounding_text, _input_done
+}
+
+static const struct wl_pointer_listener g_pointer_listener = {
+	_pointer_enter, _pointer_leave, _pointer_motion, _pointer_button,
+	_pointer_axis, _pointer_frame, _pointer_axis_source, _pointer_axis_stop,
+	_pointer_axis_discrete
 };
 
 
@@ -119,6 +1304,7 @@ static const struct zwp_text_input_v3_listener g_text_input_listener = {
 static void _keyboard_keymap(void *data, struct wl_keyboard *keyboard,
 	uint32_t format, int32_t fd, uint32_t size)
 {
+	close(fd);
 }
 
 static void _keyboard_enter(void *data, struct wl_keyboard *keyboard,
@@ -138,7 +1324,7 @@ static void _keyboard_leave(void *data, struct wl_keyboard *keyboard,
 static void _keyboard_key(void *data, struct wl_keyboard *keyboard,
 	uint32_t serial, uint32_t time, uint32_t key, uint32_t state)
 {
-	Client *p = (Client *)data;
+	Client *p = ((Seat *)data)->client;
 
 	printf("wl_keyboard # key | %s, key:%u\n",
 		(state == WL_KEYBOARD_KEY_STATE_PRESSED)? "press":"release", key);
@@ -151,13 +1337,24 @@ static void _keyboard_key(void *data, struct wl_keyboard *keyboard,
 		case KEY_ESC:
 			p->finish_loop = 1;
 			break;
+		//Ctrl+V で貼り付け
+		case KEY_V:
+			if(((InputSeat *)data)->mods & MOD_MASK_CONTROL)
+				_paste_start(p, (InputSeat *)data);
+			break;
+		//Ctrl+Z でアンドゥ、Ctrl+Shift+Z/Ctrl+Y でリドゥ
+		case KEY_Z:
+		case KEY_Y:
+			if(((InputSeat *)data)->mods & MOD_MASK_CONTROL)
+				_undo_redo(p, key == KEY_Y || (((InputSeat *)data)->mods & MOD_MASK_SHIFT));
+			break;
 	}
 }
 
 static void _keyboard_modifiers(void *data, struct wl_keyboard *keyboard,
 	uint32_t serial, uint32_t mods_depressed, uint32_t mods_latched, uint32_t mods_locked, uint32_t group)
 {
-
+	((InputSeat *)data)->mods = mods_depressed;
 }
 
 static void _keyboard_repeat_info(void *data, struct wl_keyboard *keyboard,
@@ -175,72 +1372,409 @@ static const struct wl_keyboard_listener g_keyboard_listener = {
 //------------------------
 
 
-static void _registry_global(
-    void *data,struct wl_registry *reg,uint32_t id,const char *name,uint32_t ver)
+/* seat の zwp_text_input_v3 を入力用のキューに作成
+ *
+ * 入力スレッドの実行中は、ロックして呼ぶこと */
+
+static void _seat_create_text_input(Client *p,InputSeat *st)
+{
+	struct zwp_text_input_manager_v3 *wrapper;
+	struct wl_event_queue *queue;
+
+	if(st->text_input || !g_input_manager) return;
+
+	queue = Client_get_input_queue(p);
+	if(!queue) return;
+
+	if(!st->pending.arena)
+	{
+		st->pending.arena = MemArena_new(0);
+		if(!st->pending.arena) return;
+	}
+
+	wrapper = (struct zwp_text_input_manager_v3 *)wl_proxy_create_wrapper(g_input_manager);
+	if(!wrapper) return;
+
+	wl_proxy_set_queue((struct wl_proxy *)wrapper, queue);
+
+	st->text_input = zwp_text_input_manager_v3_get_text_input(wrapper, st->s.seat);
+
+	wl_proxy_wrapper_destroy(wrapper);
+
+	if(st->text_input)
+	{
+		st->preedit_cursor = -1;
+
+		zwp_text_input_v3_add_listener(st->text_input,
+			&g_text_input_listener, st);
+	}
+}
+
+/* seat の zwp_text_input_v3 と入力状態を破棄 */
+
+static void _seat_destroy_text_input(InputSeat *st)
 {
-	if(strcmp(name, "zwp_text_input_manager_v3") == 0)
+	if(st->text_input)
 	{
-		g_input_manager = wl_registry_bind(reg, id,
-			&zwp_text_input_manager_v3_interface, 1);
+		zwp_text_input_v3_destroy(st->text_input);
+		st->text_input = NULL;
 	}
+
+	_pending_clear(&st->pending);
+
+	MemArena_destroy(st->pending.arena);
+	st->pending.arena = NULL;
+
+	free(st->preedit_buf);
+	st->preedit_buf = st->preedit = NULL;
+	st->preedit_alloc = 0;
+	st->focus = 0;
+}
+
+/* zwp_text_input_manager_v3
+ *
+ * 既にある seat の text_input を作成する */
+
+static int _text_input_manager_bind(Client *p,void *proxy,uint32_t ver)
+{
+	int i;
+
+	if(g_input_manager) return 1;
+
+	g_input_manager = (struct zwp_text_input_manager_v3 *)proxy;
+
+	Client_input_lock(p);
+
+	for(i = 0; i < p->seat_num; i++)
+		_seat_create_text_input(p, (InputSeat *)p->seats[i]);
+
+	Client_input_unlock(p);
+
+	return 0;
+}
+
+static void _text_input_manager_remove(Client *p,void *proxy)
+{
+	int i;
+
+	Client_input_lock(p);
+
+	for(i = 0; i < p->seat_num; i++)
+		_seat_destroy_text_input((InputSeat *)p->seats[i]);
+
+	Client_input_unlock(p);
+
+	zwp_text_input_manager_v3_destroy(g_input_manager);
+	g_input_manager = NULL;
+}
+
+static const ClientGlobal g_global_text_input_manager = {
+	&zwp_text_input_manager_v3_interface, 1, 1,
+	_text_input_manager_bind, _text_input_manager_remove
+};
+
+/* wl_seat 追加時 */
+
+static void _seat_add(Client *p,Seat *seat)
+{
+	Client_input_lock(p);
+
+	_seat_create_text_input(p, (InputSeat *)seat);
+
+	Client_input_unlock(p);
+
+	_seat_create_data_device((InputSeat *)seat);
+}
+
+/* wl_seat 削除時 */
+
+static void _seat_remove(Client *p,Seat *seat)
+{
+	Client_input_lock(p);
+
+	_seat_destroy_text_input((InputSeat *)seat);
+
+	if(g_undo_seat == (InputSeat *)seat)
+		g_undo_seat = NULL;
+
+	Client_input_unlock(p);
+
+	_seat_destroy_data_device((InputSeat *)seat);
+
+	//preedit の表示を消す (ロックした状態で再描画される)
+
+	if(g_win)
+		Window_setDirty(g_win);
+}
+
+/* 再接続後
+ *
+ * seat はフォーカスがない状態で作り直されるので、アイドル時のタイマーを開始する。
+ * テキストやイメージはそのまま残っていて、最初の configure 時に表示される。 */
+
+static void _reconnected(Client *p)
+{
+	Client_input_lock(p);
+
+	_idle_update(p);
+
+	Client_input_unlock(p);
 }
 
 
 //---------------
 
 
-int main(void)
+/* ウィンドウのイメージを作成して描画 */
+
+static ImageBuf *_create_image(Client *p)
+{
+	ImageBuf *img;
+
+	if(!Client_get_arena(p)) return NULL;
+
+	img = ImageBuf_newArena(p->arena, 256, 256, p->image_format);
+
+	if(img)
+		_draw(p, img, NULL);
+
+	return img;
+}
+
+/* 描画用のデータを削除 */
+
+static void _free_draw(void)
+{
+	_session_close();
+
+	TextBuf_destroy(g_text);
+	TextUndo_destroy(g_undo);
+	DrawList_destroy(g_list);
+	DrawList_destroy(g_list_prev);
+	TileRender_destroy(g_tiles);
+}
+
+/* --rgb565 : RGB565 で描画する (メモリ使用量が半分)
+ * --low-power : 半分の解像度で描画して、コンポジタで拡大する
+ * --bench-tiles : タイル分割描画の計測のみ行う
+ * --idle-trim SEC : フォーカスがなくなってから SEC 秒でメモリを解放 (0 でしない)
+ * --undo-cap KB : アンドゥ履歴の最大サイズ
+ * --bench-draw FILE : 描画のベンチマークのみ行い、結果を FILE に出力
+ *   (--bench-golden DIR, --bench-base FILE, --bench-threshold PCT,
+ *    --bench-update : DIR にないゴールデンイメージを保存する)
+ * --session FILE : テキストを FILE に保持して、次回の起動時に復元する
+ * --reconnect : コンポジタとの接続が切れた場合、テキストなどを保持したまま再接続する */
+
+int main(int argc,char **argv)
 {
 	Client *p;
-	Window *win;
+	ImageBuf *img;
+	DrawBenchOpt bench_opt;
+	const char *session_file = NULL;
+	int i,low_power = 0,bench = 0;
 
 	p = Client_new(0);
 
-	p->init_flags = INIT_FLAGS_SEAT | INIT_FLAGS_KEYBOARD;
+	p->image_format = WL_SHM_FORMAT_XRGB8888;
+
+	memset(&bench_opt, 0, sizeof(DrawBenchOpt));
+	bench_opt.threshold = 10;
+
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--rgb565") == 0)
+			p->image_format = WL_SHM_FORMAT_RGB565;
+		else if(strcmp(argv[i], "--low-power") == 0)
+			low_power = 1;
+		else if(strcmp(argv[i], "--bench-tiles") == 0)
+			bench = 1;
+		else if(strcmp(argv[i], "--idle-trim") == 0 && i + 1 < argc)
+			g_idle_sec = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--undo-cap") == 0 && i + 1 < argc)
+			g_undo_cap = atoi(argv[++i]) * 1024;
+		else if(strcmp(argv[i], "--bench-draw") == 0 && i + 1 < argc)
+		{
+			bench = 2;
+			bench_opt.output = argv[++i];
+		}
+		else if(strcmp(argv[i], "--bench-golden") == 0 && i + 1 < argc)
+			bench_opt.golden = argv[++i];
+		else if(strcmp(argv[i], "--bench-base") == 0 && i + 1 < argc)
+			bench_opt.base = argv[++i];
+		else if(strcmp(argv[i], "--bench-threshold") == 0 && i + 1 < argc)
+			bench_opt.threshold = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--bench-update") == 0)
+			bench_opt.update = 1;
+		else if(strcmp(argv[i], "--session") == 0 && i + 1 < argc)
+			session_file = argv[++i];
+		else if(strcmp(argv[i], "--reconnect") == 0)
+			p->reconnect = 1;
+	}
+
+	//描画のベンチマーク (コンポジタに接続しない)
+	//遅くなった項目か、ゴールデンイメージと異なる項目があれば 1 で終了
+
+	if(bench == 2)
+	{
+		Client_destroy(p);
+		return (DrawBench_run(&bench_opt) == 0)? 0: 1;
+	}
+
+	g_text = TextBuf_new(0);
+	g_undo = TextUndo_new(g_undo_cap);
+	g_list = DrawList_new();
+	g_list_prev = DrawList_new();
+	g_tiles = TileRender_new(0);
+
+	if(!g_text || !g_undo || !g_list || !g_list_prev || !g_tiles)
+	{
+		_free_draw();
+		Client_destroy(p);
+		return 1;
+	}
+
+	if(bench)
+	{
+		_bench_tiles(p);
+		_free_draw();
+		Client_destroy(p);
+		return 0;
+	}
+
+	//接続前に復元しておく (最初の描画で使う)
+
+	if(session_file)
+		_session_open(session_file);
+
+	p->init_flags = INIT_FLAGS_SEAT | INIT_FLAGS_POINTER | INIT_FLAGS_KEYBOARD;
+	p->pointer_listener = &g_pointer_listener;
 	p->keyboard_listener = &g_keyboard_listener;
-	p->registry_global = _registry_global;
+	p->seat_size = sizeof(InputSeat);
+	p->seat_add = _seat_add;
+	p->seat_remove = _seat_remove;
+	p->reconnected = _reconnected;
+
+	Client_add_global(p, &g_global_text_input_manager);
+	Client_add_global(p, &g_global_data_device_manager);
 	
-	Client_init(p);
+	//接続できなければ終了 (--reconnect の場合は、タイムアウトまで繰り返した後)
 
-	if(!g_input_manager)
+	if(Client_connect(p))
 	{
-		printf("[!] not found 'zwp_text_input_manager_v3'\n");
 		Client_destroy(p);
+		_free_draw();
 		return 1;
 	}
 
-	//zwp_text_input
+	//レジストリの往復を待つ間に、イメージを確保して描画しておく
 
-	g_text_input = zwp_text_input_manager_v3_get_text_input(
-		g_input_manager, p->seat);
+	img = _create_image(p);
 
-	zwp_text_input_v3_add_listener(g_text_input,
-		&g_text_input_listener, p);
+	if(Client_wait_init(p))
+	{
+		ImageBuf_destroy(img);
+		Client_destroy(p);
+		_free_draw();
+		return 1;
+	}
 
-	//ウィンドウ
+	//RGB565 に対応していない場合は XRGB8888 で作り直す
 
-	win = Window_create(p, 256, 256, NULL);
+	if(img && !Client_has_shm_format(p, img->format))
+	{
+		printf("[!] RGB565 is not supported, using XRGB8888\n");
 
-	ImageBuf_fill(win->img, 0xffff0000);
+		ImageBuf_destroy(img);
+		g_drawn_img = NULL;
 
-	ImageBuf_box(win->img,
-		INPUTBOX_X, INPUTBOX_Y, INPUTBOX_W, INPUTBOX_H,
-		0xff000000);
+		p->image_format = WL_SHM_FORMAT_XRGB8888;
+		img = _create_image(p);
+	}
+
+	if(!g_input_manager || !img)
+	{
+		if(!g_input_manager)
+			printf("[!] not found 'zwp_text_input_manager_v3'\n");
+
+		ImageBuf_destroy(img);
+		Client_destroy(p);
+		_free_draw();
+		return 1;
+	}
+
+	//ウィンドウ (表示は最初の configure 時)
+
+	g_win = Window_createWithImage(p, img, NULL);
+
+	if(!g_win)
+	{
+		ImageBuf_destroy(img);
+		Client_destroy(p);
+		_free_draw();
+		return 1;
+	}
 	
-	Window_update(win);
+	g_win->draw = _window_draw;
+	g_win->updated = _window_updated;
+	g_win->opaque = 1;
+
+	if(low_power)
+	{
+		if(p->viewporter)
+			Window_setLowPower(g_win, 1);
+		else
+			printf("[!] not found 'wp_viewporter', --low-power is ignored\n");
+	}
+
+	Window_updateOpaque(g_win);
+
+	/* zwp_text_input (入力スレッドで処理)
+	 * seat ごとの text_input は、seat/manager のバインド時に作成済み */
+
+	g_redraw_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if(g_redraw_fd < 0
+		|| Client_input_thread_start(p))
+	{
+		printf("[!] failed to start the input thread\n");
+		p->finish_loop = 1;
+	}
+	else
+		Client_poll_add(p, g_redraw_fd, POLLIN, _redraw_handle);
+
+	//アイドル時の解放 (最初はフォーカスがないので開始)
+
+	if(g_idle_sec > 0)
+	{
+		g_idle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+		if(g_idle_fd >= 0)
+		{
+			Client_poll_add(p, g_idle_fd, POLLIN, _idle_handle);
+
+			Client_input_lock(p);
+			_idle_update(p);
+			Client_input_unlock(p);
+		}
+	}
 
 	//
 
-	Client_loop_simple(p);
+	Client_loop_poll(p);
+
+	_latency_report();
 
 	//解放
 
-	Window_destroy(win);
+	Window_destroy(g_win);
+	g_win = NULL;
 
-	zwp_text_input_v3_destroy(g_text_input);
-	zwp_text_input_manager_v3_destroy(g_input_manager);
+	//zwp_text_input_manager_v3 などは Client_destroy() 内で破棄される
+	//(g_redraw_fd は poll のリストと共に閉じられる)
 
 	Client_destroy(p);
 
+	_free_draw();
+
 	return 0;
 }
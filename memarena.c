@@ -0,0 +1,119 @@
+/******************************
+ * バンプアロケータ
+ ******************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memarena.h"
+
+
+/* 作成
+ *
+ * block_size: 最初のブロックのサイズ。0 以下で 4096。
+ *  ブロックは最初の確保時に作成する。 */
+
+MemArena *MemArena_new(int block_size)
+{
+	MemArena *p;
+
+	p = (MemArena *)calloc(1, sizeof(MemArena));
+	if(!p) return NULL;
+
+	p->block_size = (block_size > 0)? block_size: 4096;
+
+	return p;
+}
+
+/* 削除 */
+
+void MemArena_destroy(MemArena *p)
+{
+	MemArenaBlock *b,*prev;
+
+	if(!p) return;
+
+	for(b = p->cur; b; b = prev)
+	{
+		prev = b->prev;
+		free(b);
+	}
+
+	free(p);
+}
+
+/* すべて解放
+ *
+ * ブロックが1つなら、使用サイズを戻すだけ */
+
+void MemArena_reset(MemArena *p)
+{
+	MemArenaBlock *b,*prev;
+
+	if(p->cur)
+	{
+		for(b = p->cur->prev; b; b = prev)
+		{
+			prev = b->prev;
+			free(b);
+		}
+
+		p->cur->prev = NULL;
+	}
+
+	p->used = 0;
+	p->reset_cnt++;
+}
+
+/* 確保 (8 バイト境界)
+ *
+ * return: NULL で失敗 */
+
+void *MemArena_alloc(MemArena *p,int size)
+{
+	MemArenaBlock *b = p->cur;
+	void *ptr;
+	int n;
+
+	size = (size + 7) & ~7;
+
+	//ブロックを追加
+
+	if(!b || p->used + size > b->size)
+	{
+		n = (b)? b->size * 2: p->block_size;
+
+		while(n < size)
+			n *= 2;
+
+		b = (MemArenaBlock *)malloc(sizeof(MemArenaBlock) + n);
+		if(!b) return NULL;
+
+		b->prev = p->cur;
+		b->size = n;
+
+		p->cur = b;
+		p->used = 0;
+		p->block_cnt++;
+	}
+
+	ptr = b->data + p->used;
+	p->used += size;
+
+	return ptr;
+}
+
+/* 文字列を複製 */
+
+char *MemArena_strdup(MemArena *p,const char *str)
+{
+	char *buf;
+	int len;
+
+	len = strlen(str) + 1;
+
+	buf = (char *)MemArena_alloc(p, len);
+	if(buf) memcpy(buf, str, len);
+
+	return buf;
+}
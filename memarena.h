@@ -0,0 +1,40 @@
+#ifndef _MEMARENA_H_
+#define _MEMARENA_H_
+
+/* バンプアロケータ
+ *
+ * 確保は先頭から順に切り出すだけで、個別の解放はしない。
+ * MemArena_reset() で、確保したものをすべてまとめて捨てる。
+ *
+ * 足りなくなった場合は、倍のサイズのブロックを追加する
+ * (確保済みのポインタはリセットまで有効)。
+ * リセット時は最後の (最も大きい) ブロックだけを残すので、
+ * 同じ程度の使用量が続く間は malloc() を行わない。 */
+
+typedef struct _MemArenaBlock MemArenaBlock;
+typedef struct _MemArena MemArena;
+
+struct _MemArenaBlock
+{
+	MemArenaBlock *prev;
+	int size,
+		pad;	//data を 8 バイト境界にする
+	char data[];
+};
+
+struct _MemArena
+{
+	MemArenaBlock *cur;	//現在のブロック (NULL でなし)
+	int used,			//cur の使用サイズ
+		block_size,		//最初のブロックのサイズ
+		block_cnt,		//ブロックを確保した回数 (統計用)
+		reset_cnt;		//リセットした回数 (統計用)
+};
+
+MemArena *MemArena_new(int block_size);
+void MemArena_destroy(MemArena *p);
+void MemArena_reset(MemArena *p);
+void *MemArena_alloc(MemArena *p,int size);
+char *MemArena_strdup(MemArena *p,const char *str);
+
+#endif
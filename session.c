@@ -0,0 +1,491 @@
+/******************************
+ * セッションファイル
+ ******************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "textbuf.h"
+#include "session.h"
+
+
+#define SESSION_PAGE  4096
+#define _PAGE_ROUND(n)  (((n) + SESSION_PAGE - 1) & ~(SESSION_PAGE - 1))
+
+#define _HEADER(p)  ((SessionHeader *)(p)->map)
+#define _LINES(p)   ((uint32_t *)((p)->map + _HEADER(p)->line_offset))
+
+
+/* ファイルの配置を変更
+ *
+ * バッファは先頭のページの後ろで固定なので、
+ * バッファのサイズが同じなら、行インデックスの位置も変わらない。
+ * ファイルは拡張のみ行う (内容は残る)。
+ *
+ * return: 0 で成功 */
+
+static int _set_layout(Session *p,int buf_size,int line_cap)
+{
+	SessionHeader *hd;
+	void *map;
+	int line_offset,size;
+
+	line_offset = SESSION_PAGE + _PAGE_ROUND(buf_size);
+	size = line_offset + _PAGE_ROUND(line_cap * (int)sizeof(uint32_t));
+
+	if(size > p->map_size)
+	{
+		if(ftruncate(p->fd, size)) return -1;
+
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+		if(map == MAP_FAILED) return -1;
+
+		if(p->map)
+			munmap(p->map, p->map_size);
+
+		p->map = (uint8_t *)map;
+		p->map_size = size;
+	}
+
+	hd = _HEADER(p);
+
+	hd->buf_size = buf_size;
+	hd->buf_offset = SESSION_PAGE;
+	hd->line_cap = line_cap;
+	hd->line_offset = line_offset;
+
+	return 0;
+}
+
+/* 範囲をファイルへ書き出す (非同期)
+ *
+ * msync() はページ境界から */
+
+static void _sync(Session *p,int offset,int size)
+{
+	int top;
+
+	if(size <= 0) return;
+
+	top = offset & ~(SESSION_PAGE - 1);
+
+	msync(p->map + top, offset + size - top, MS_ASYNC);
+}
+
+/* 次の行の先頭を取得
+ *
+ * 表示と同じく、UTF-8 の1文字を1セルとして cols 文字ごとに折り返し、
+ * 改行の次の位置からも新しい行とする。
+ *
+ * top: 行の先頭
+ * return: 次の行の先頭。-1 でテキストの終端までこの行 */
+
+static int _next_line(TextBuf *tb,int top,int len,int cols)
+{
+	int i,c,cnt = 0;
+
+	for(i = top; i < len; i++)
+	{
+		c = TextBuf_getChar(tb, i);
+
+		if((c & 0xc0) == 0x80) continue;
+
+		if(c == '\n') return i + 1;
+
+		if(cnt == cols) return i;
+
+		cnt++;
+	}
+
+	return -1;
+}
+
+/* 位置 pos 以降の行インデックスを作り直す
+ *
+ * pos を含む行の先頭から走査する。
+ * 変更されていない範囲 (end 以降) で、行の先頭が
+ * 古い行の先頭 + delta と一致した場合、それ以降の行は同じなので、
+ * 残りは位置をずらすだけにして、変更された行だけを書き込む。
+ *
+ * end: 変更後のテキストで、末尾まで変更されていない範囲の先頭 (-1 で最後まで走査)
+ * delta: 変更によるテキストの長さの増減
+ * return: 0 で成功 */
+
+static int _update_lines(Session *p,TextBuf *tb,int cols,int pos,int end,int delta)
+{
+	SessionHeader *hd = _HEADER(p);
+	uint32_t *lines;
+	int top,bottom,mid,no,first,i,len,old_num,match,k,num,cap;
+
+	if(cols < 1) cols = 1;
+
+	/* pos を含む行 (先頭位置が pos より前の最後の行)
+	 * pos が行の先頭の場合も、その位置の文字が変わっている場合があるので、前の行から */
+
+	no = 0;
+	old_num = 0;
+
+	if(hd->line_cols == cols && hd->line_num)
+	{
+		lines = _LINES(p);
+
+		top = 0;
+		bottom = hd->line_num - 1;
+
+		while(top < bottom)
+		{
+			mid = (top + bottom + 1) / 2;
+
+			if(lines[mid] < pos)
+				top = mid;
+			else
+				bottom = mid - 1;
+		}
+
+		no = top;
+		old_num = hd->line_num;
+	}
+
+	hd->line_cols = cols;
+
+	if(no == 0)
+		_LINES(p)[0] = 0;
+
+	first = no;
+	len = TextBuf_getLength(tb);
+
+	/* 古い行と一致する行を探す (書き込まずに走査)
+	 * match: 一致した新しい行の番号 (-1 でなし)、k: 一致した古い行の番号 */
+
+	match = -1;
+	k = no + 1;
+
+	if(old_num && end >= 0)
+	{
+		lines = _LINES(p);
+
+		for(i = lines[no]; (i = _next_line(tb, i, len, cols)) >= 0; )
+		{
+			no++;
+
+			if(i < end) continue;
+
+			while(k < old_num && (int)lines[k] + delta < i)
+				k++;
+
+			if(k == old_num) break;
+
+			if((int)lines[k] + delta == i)
+			{
+				match = no;
+				break;
+			}
+		}
+
+		no = first;
+	}
+
+	//一致した行以降をずらす
+
+	if(match >= 0)
+	{
+		num = match + old_num - k;
+
+		if(num > hd->line_cap)
+		{
+			for(cap = hd->line_cap * 2; cap < num; cap *= 2);
+
+			if(_set_layout(p, hd->buf_size, cap))
+				return -1;
+
+			hd = _HEADER(p);
+		}
+
+		lines = _LINES(p);
+
+		if(match != k)
+			memmove(lines + match, lines + k, (old_num - k) * sizeof(uint32_t));
+
+		if(delta)
+		{
+			for(i = match; i < num; i++)
+				lines[i] += delta;
+		}
+	}
+
+	//変更された行を書き込む (一致した行の手前まで)
+
+	for(i = _LINES(p)[no]; (i = _next_line(tb, i, len, cols)) >= 0; )
+	{
+		if(++no == match) break;
+
+		if(no >= hd->line_cap)
+		{
+			if(_set_layout(p, hd->buf_size, hd->line_cap * 2))
+				return -1;
+
+			hd = _HEADER(p);
+		}
+
+		_LINES(p)[no] = i;
+	}
+
+	//書き込んだ範囲を同期
+
+	if(match < 0)
+		num = hd->line_num = no + 1;
+	else
+	{
+		num = hd->line_num = match + old_num - k;
+
+		//以降の行が変わっていない場合は、一致した行の手前まで
+
+		if(!delta && match == k)
+			num = match;
+	}
+
+	_sync(p, hd->line_offset + first * sizeof(uint32_t), (num - first) * sizeof(uint32_t));
+
+	return 0;
+}
+
+//=====================
+
+
+/* 開く
+ *
+ * ファイルがなければ作成する。
+ * 内容が使えない場合は、最初の Session_update() で作り直す。 */
+
+Session *Session_open(const char *filename)
+{
+	Session *p;
+	SessionHeader *hd;
+	struct stat st;
+	void *map;
+
+	p = (Session *)calloc(1, sizeof(Session));
+	if(!p) return NULL;
+
+	p->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(p->fd < 0) goto ERR;
+
+	if(fstat(p->fd, &st)) goto ERR;
+
+	//既存のファイル
+
+	if(st.st_size >= SESSION_PAGE && st.st_size <= INT32_MAX)
+	{
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+		if(map == MAP_FAILED) goto ERR;
+
+		p->map = (uint8_t *)map;
+		p->map_size = st.st_size;
+
+		hd = _HEADER(p);
+
+		if(hd->magic == SESSION_MAGIC && hd->version == SESSION_VERSION
+			&& hd->buf_offset == SESSION_PAGE
+			&& hd->line_offset == SESSION_PAGE + _PAGE_ROUND(hd->buf_size)
+			&& hd->line_offset + _PAGE_ROUND(hd->line_cap * 4) <= st.st_size
+			&& hd->line_num <= hd->line_cap)
+			return p;
+
+		hd->valid = 0;
+	}
+
+	//新規
+
+	if(_set_layout(p, 0, 1024)) goto ERR;
+
+	hd = _HEADER(p);
+
+	hd->magic = SESSION_MAGIC;
+	hd->version = SESSION_VERSION;
+	hd->valid = 0;
+	hd->line_num = 0;
+
+	return p;
+
+ERR:
+	Session_close(p);
+	return NULL;
+}
+
+/* 閉じる */
+
+void Session_close(Session *p)
+{
+	if(p)
+	{
+		if(p->map)
+		{
+			msync(p->map, p->map_size, MS_ASYNC);
+			munmap(p->map, p->map_size);
+		}
+
+		if(p->fd >= 0)
+			close(p->fd);
+
+		free(p);
+	}
+}
+
+/* 保存されているテキストを復元
+ *
+ * バッファの範囲をマッピングするだけで、テキストのコピーは行わない。
+ * 最初のフレームを描画できるように、表示される先頭の rows 行
+ * (行インデックスの cols が同じ場合) だけをここで読み込み、
+ * 残りは非同期に先読みさせる。
+ *
+ * return: NULL で復元できない */
+
+TextBuf *Session_restore(Session *p,int cols,int rows)
+{
+	SessionHeader *hd = _HEADER(p);
+	TextBuf *tb;
+	volatile char c;
+	int end,i,n;
+
+	if(!hd->valid || hd->cursor != hd->gap_top) return NULL;
+
+	tb = TextBuf_newMap(p->fd, hd->buf_offset, hd->buf_size, hd->gap_top, hd->gap_end);
+	if(!tb) return NULL;
+
+	//表示される範囲
+
+	end = TextBuf_getLength(tb);
+
+	if(hd->line_cols == cols && rows < hd->line_num)
+		end = _LINES(p)[rows];
+
+	//先頭から end までを読み込む (ページごとに1バイト読む)
+
+	n = (end < tb->gap_top)? end: tb->gap_top;
+
+	for(i = 0; i < n; i += SESSION_PAGE)
+		c = tb->buf[i];
+
+	n = end - tb->gap_top;
+
+	for(i = 0; i < n; i += SESSION_PAGE)
+		c = tb->buf[tb->gap_end + i];
+
+	(void)c;
+
+	//残りは先読み
+
+	madvise(tb->buf, tb->size, MADV_WILLNEED);
+
+	p->synced = 1;
+
+	return tb;
+}
+
+/* TextBuf の変更を書き込む
+ *
+ * TextBuf_clearDirty() 以降に変更された範囲と、
+ * 変更された行のインデックスだけを書き込んで、変更範囲をクリアする。
+ * バッファのサイズが変わった場合や、復元していない場合は全体を書き込む。
+ *
+ * 書き込み中は valid を 0 にしておき、途中で終了した場合は次回復元しない。
+ *
+ * cols: 行インデックスの1行の文字数
+ * return: 0 で成功 */
+
+int Session_update(Session *p,TextBuf *tb,int cols)
+{
+	SessionHeader *hd = _HEADER(p);
+	int top,end,pos,same,delta,n,full;
+
+	full = (!p->synced || hd->buf_size != tb->size);
+
+	if(full)
+	{
+		top = 0;
+		end = tb->size;
+		pos = 0;
+		same = -1;
+		delta = 0;
+	}
+	else
+	{
+		top = tb->dirty_top;
+		end = tb->dirty_end;
+		pos = tb->dirty_pos;
+
+		if(hd->line_cols != cols)
+			pos = 0;
+
+		/* 編集はギャップの位置で行われるので、書き換えた範囲と前後のギャップより
+		 * 後ろのバッファは変わっていない。その範囲のテキスト位置は delta だけずれる */
+
+		delta = TextBuf_getLength(tb) - ((int)hd->buf_size - ((int)hd->gap_end - (int)hd->gap_top));
+
+		n = end;
+		if(n < (int)hd->gap_end) n = hd->gap_end;
+		if(n < tb->gap_end) n = tb->gap_end;
+
+		same = n - (tb->gap_end - tb->gap_top);
+
+		//変更なし
+
+		if(top >= end && pos < 0
+			&& hd->gap_top == tb->gap_top && hd->gap_end == tb->gap_end)
+			return 0;
+	}
+
+	//レイアウトやヘッダを変更する前に、無効にしたヘッダを書き出す
+	//(_update_lines() でも、行インデックスの拡張時にレイアウトが変わる)
+
+	hd->valid = 0;
+
+	_sync(p, 0, sizeof(SessionHeader));
+
+	//全体
+
+	if(full)
+	{
+		if(_set_layout(p, tb->size, hd->line_cap))
+			return -1;
+
+		hd = _HEADER(p);
+	}
+
+	//バッファ
+
+	if(top < end)
+	{
+		memcpy(p->map + hd->buf_offset + top, tb->buf + top, end - top);
+
+		_sync(p, hd->buf_offset + top, end - top);
+	}
+
+	//行インデックス
+
+	if(pos >= 0 && _update_lines(p, tb, cols, pos, same, delta))
+	{
+		p->synced = 0;
+		return -1;
+	}
+
+	hd = _HEADER(p);
+
+	hd->gap_top = tb->gap_top;
+	hd->gap_end = tb->gap_end;
+	hd->cursor = hd->anchor = tb->gap_top;
+	hd->valid = 1;
+
+	_sync(p, 0, sizeof(SessionHeader));
+
+	TextBuf_clearDirty(tb);
+
+	p->synced = 1;
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+/* セッションファイル
+ *
+ * 再起動時にテキストを復元するため、編集状態をファイルに保持する。
+ * ポインタを含まない固定の配置で、ファイル全体を MAP_SHARED でマッピングして更新する。
+ *
+ * [SessionHeader (1ページ)]
+ * [TextBuf のバッファ (ギャップを含むそのままの内容。ページ単位)]
+ * [行インデックス (uint32_t: 各行の先頭のテキスト位置。ページ単位)]
+ *
+ * 更新時は、TextBuf の変更範囲と、変更された行のインデックスだけを書き込む
+ * (以降の行は位置をずらす)。
+ * 復元時は、バッファの範囲を TextBuf として直接マッピングする。 */
+
+#define SESSION_MAGIC    0x31535454	//"TTS1"
+#define SESSION_VERSION  1
+
+typedef struct
+{
+	uint32_t magic,
+		version,
+		valid,			//0 で未作成か更新中 (復元しない)
+		buf_size,		//TextBuf::size
+		gap_top,		//TextBuf::gap_top
+		gap_end,		//TextBuf::gap_end
+		cursor,			//カーソル位置
+		anchor,			//選択の起点 (選択がないので cursor と同じ)
+		line_cols,		//1行の文字数
+		line_num,		//行数
+		line_cap,		//行インデックスの確保数
+		buf_offset,		//ファイル内の位置
+		line_offset;
+}SessionHeader;
+
+typedef struct _Session Session;
+
+struct _Session
+{
+	uint8_t *map;		//ファイル全体のマッピング
+	int fd,
+		map_size,
+		synced;			//ファイルの内容が TextBuf と一致している (0 で次の更新時に全体を書き込む)
+};
+
+Session *Session_open(const char *filename);
+void Session_close(Session *p);
+TextBuf *Session_restore(Session *p,int cols,int rows);
+int Session_update(Session *p,TextBuf *tb,int cols);
+
+#endif
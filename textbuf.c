@@ -0,0 +1,316 @@
+/******************************
+ * テキスト (ギャップバッファ)
+ ******************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "textbuf.h"
+
+
+/* buf の書き換えた範囲を追加 */
+
+static void _add_dirty(TextBuf *p,int top,int end)
+{
+	if(top >= end) return;
+
+	if(p->dirty_top >= p->dirty_end)
+	{
+		p->dirty_top = top;
+		p->dirty_end = end;
+	}
+	else
+	{
+		if(top < p->dirty_top) p->dirty_top = top;
+		if(end > p->dirty_end) p->dirty_end = end;
+	}
+}
+
+/* 変更したテキストの位置を追加 */
+
+static void _add_dirty_pos(TextBuf *p,int pos)
+{
+	if(p->dirty_pos < 0 || pos < p->dirty_pos)
+		p->dirty_pos = pos;
+}
+
+
+//=====================
+
+
+/* 作成
+ *
+ * size: 初期確保サイズ */
+
+TextBuf *TextBuf_new(int size)
+{
+	TextBuf *p;
+
+	if(size < 64) size = 64;
+
+	p = (TextBuf *)calloc(1, sizeof(TextBuf));
+	if(!p) return NULL;
+
+	p->buf = (char *)malloc(size);
+	if(!p->buf)
+	{
+		free(p);
+		return NULL;
+	}
+
+	p->size = size;
+	p->gap_end = size;
+	p->dirty_pos = -1;
+
+	return p;
+}
+
+/* ファイルの内容をバッファとして作成
+ *
+ * バッファの内容 (ギャップを含む) をそのまま MAP_PRIVATE でマッピングする。
+ * 読み込みはページ単位で、アクセスした時に行われる。
+ * 書き換えてもファイルには反映されない。
+ *
+ * offset: ページ境界であること */
+
+TextBuf *TextBuf_newMap(int fd,off_t offset,int size,int gap_top,int gap_end)
+{
+	TextBuf *p;
+	void *buf;
+
+	if(size <= 0 || gap_top < 0 || gap_top > gap_end || gap_end > size)
+		return NULL;
+
+	p = (TextBuf *)calloc(1, sizeof(TextBuf));
+	if(!p) return NULL;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+
+	if(buf == MAP_FAILED)
+	{
+		free(p);
+		return NULL;
+	}
+
+	p->buf = (char *)buf;
+	p->size = size;
+	p->gap_top = gap_top;
+	p->gap_end = gap_end;
+	p->mapped = 1;
+	p->dirty_pos = -1;
+
+	return p;
+}
+
+/* 削除 */
+
+void TextBuf_destroy(TextBuf *p)
+{
+	if(p)
+	{
+		if(p->mapped)
+			munmap(p->buf, p->size);
+		else
+			free(p->buf);
+
+		free(p);
+	}
+}
+
+/* テキストのバイト数 */
+
+int TextBuf_getLength(TextBuf *p)
+{
+	return p->size - (p->gap_end - p->gap_top);
+}
+
+/* カーソル位置 (バイト) */
+
+int TextBuf_getCursor(TextBuf *p)
+{
+	return p->gap_top;
+}
+
+/* 指定位置のバイトを取得 */
+
+int TextBuf_getChar(TextBuf *p,int pos)
+{
+	if(pos >= p->gap_top)
+		pos += p->gap_end - p->gap_top;
+
+	return (uint8_t)p->buf[pos];
+}
+
+/* ギャップが len バイト以上になるように確保
+ *
+ * 足りない場合は、倍々に拡張する。
+ * return: 0 で成功 */
+
+int TextBuf_reserve(TextBuf *p,int len)
+{
+	char *buf;
+	int size,after;
+
+	if(p->gap_end - p->gap_top >= len) return 0;
+
+	size = p->size;
+
+	while(size - TextBuf_getLength(p) < len)
+		size *= 2;
+
+	after = p->size - p->gap_end;
+
+	if(p->mapped)
+	{
+		//マッピングからコピーする
+
+		buf = (char *)malloc(size);
+		if(!buf) return -1;
+
+		memcpy(buf, p->buf, p->gap_top);
+		memcpy(buf + size - after, p->buf + p->gap_end, after);
+
+		munmap(p->buf, p->size);
+		p->mapped = 0;
+	}
+	else
+	{
+		buf = (char *)realloc(p->buf, size);
+		if(!buf) return -1;
+
+		//後半を終端へ移動
+
+		memmove(buf + size - after, buf + p->gap_end, after);
+	}
+
+	p->buf = buf;
+	p->gap_end = size - after;
+	p->size = size;
+
+	//配置が変わるので全体
+
+	_add_dirty(p, 0, size);
+
+	return 0;
+}
+
+/* カーソル (ギャップ) を移動 */
+
+void TextBuf_moveCursor(TextBuf *p,int pos)
+{
+	int len;
+
+	if(pos < 0)
+		pos = 0;
+	else if(pos > TextBuf_getLength(p))
+		pos = TextBuf_getLength(p);
+
+	if(pos < p->gap_top)
+	{
+		//前へ: [pos, gap_top) をギャップの後ろへ
+
+		len = p->gap_top - pos;
+
+		memmove(p->buf + p->gap_end - len, p->buf + pos, len);
+
+		_add_dirty(p, p->gap_end - len, p->gap_end);
+
+		p->gap_top -= len;
+		p->gap_end -= len;
+	}
+	else if(pos > p->gap_top)
+	{
+		//後ろへ: ギャップの後ろをギャップの先頭へ
+
+		len = pos - p->gap_top;
+
+		memmove(p->buf + p->gap_top, p->buf + p->gap_end, len);
+
+		_add_dirty(p, p->gap_top, p->gap_top + len);
+
+		p->gap_top += len;
+		p->gap_end += len;
+	}
+}
+
+/* カーソル位置に挿入
+ *
+ * カーソルは挿入したテキストの後ろへ移動する。
+ * return: 0 で成功 */
+
+int TextBuf_insert(TextBuf *p,const char *text,int len)
+{
+	if(TextBuf_reserve(p, len)) return -1;
+
+	memcpy(p->buf + p->gap_top, text, len);
+
+	_add_dirty(p, p->gap_top, p->gap_top + len);
+	_add_dirty_pos(p, p->gap_top);
+
+	p->gap_top += len;
+
+	return 0;
+}
+
+/* fd から読み込んで、カーソル位置に挿入
+ *
+ * 中間のバッファを使わず、ギャップへ直接読み込む。
+ * カーソルは読み込んだテキストの後ろへ移動する。
+ *
+ * max: 最大バイト数
+ * return: 読み込んだバイト数。0 で終端、-1 でエラー (errno) */
+
+int TextBuf_readFd(TextBuf *p,int fd,int max)
+{
+	int ret;
+
+	if(TextBuf_reserve(p, max))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	do
+	{
+		ret = read(fd, p->buf + p->gap_top, max);
+	} while(ret < 0 && errno == EINTR);
+
+	if(ret > 0)
+	{
+		_add_dirty(p, p->gap_top, p->gap_top + ret);
+		_add_dirty_pos(p, p->gap_top);
+
+		p->gap_top += ret;
+	}
+
+	return ret;
+}
+
+/* カーソルの前後を削除 (バイト単位) */
+
+void TextBuf_deleteSurrounding(TextBuf *p,int before,int after)
+{
+	if(before > p->gap_top)
+		before = p->gap_top;
+
+	if(after > p->size - p->gap_end)
+		after = p->size - p->gap_end;
+
+	if(before || after)
+		_add_dirty_pos(p, p->gap_top - before);
+
+	p->gap_top -= before;
+	p->gap_end += after;
+}
+
+/* 変更した範囲をクリア */
+
+void TextBuf_clearDirty(TextBuf *p)
+{
+	p->dirty_top = p->dirty_end = 0;
+	p->dirty_pos = -1;
+}
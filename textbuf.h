@@ -0,0 +1,40 @@
+#ifndef _TEXTBUF_H_
+#define _TEXTBUF_H_
+
+/* テキスト (ギャップバッファ)
+ *
+ * UTF-8 のバイト列。カーソル位置 = ギャップの先頭。
+ *
+ * 前回の TextBuf_clearDirty() 以降に変更された範囲を記録する
+ * (セッションファイルへの差分の書き込み用)。 */
+
+typedef struct _TextBuf TextBuf;
+
+struct _TextBuf
+{
+	char *buf;
+	int size,		//確保サイズ
+		gap_top,	//ギャップの先頭 (カーソル位置)
+		gap_end,	//ギャップの終端 (この位置から後半のテキスト)
+		mapped,		//0 以外で buf はファイルを mmap したもの (拡張時に malloc へ移る)
+		dirty_top,	//書き換えた buf の範囲 (dirty_top >= dirty_end でなし)
+		dirty_end,
+		dirty_pos;	//変更したテキストの最小位置 (-1 でなし)
+};
+
+TextBuf *TextBuf_new(int size);
+TextBuf *TextBuf_newMap(int fd,off_t offset,int size,int gap_top,int gap_end);
+void TextBuf_destroy(TextBuf *p);
+
+int TextBuf_getLength(TextBuf *p);
+int TextBuf_getCursor(TextBuf *p);
+int TextBuf_getChar(TextBuf *p,int pos);
+
+int TextBuf_reserve(TextBuf *p,int len);
+void TextBuf_moveCursor(TextBuf *p,int pos);
+int TextBuf_insert(TextBuf *p,const char *text,int len);
+int TextBuf_readFd(TextBuf *p,int fd,int max);
+void TextBuf_deleteSurrounding(TextBuf *p,int before,int after);
+void TextBuf_clearDirty(TextBuf *p);
+
+#endif
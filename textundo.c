@@ -0,0 +1,365 @@
+/******************************
+ * TextBuf のアンドゥ履歴
+ ******************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "textbuf.h"
+#include "textundo.h"
+
+
+//レコード全体のサイズ
+#define _REC_SIZE(len)  (sizeof(TextUndoRec) + (((len) + 3) & ~3) + sizeof(int))
+
+
+/* 位置からレコードのヘッダを取得 */
+
+static void _get_rec(TextUndo *p,int pos,TextUndoRec *rec)
+{
+	memcpy(rec, p->buf + pos, sizeof(TextUndoRec));
+}
+
+/* pos の直前のレコードの位置 */
+
+static int _get_prev(TextUndo *p,int pos)
+{
+	int size;
+
+	memcpy(&size, p->buf + pos - sizeof(int), sizeof(int));
+
+	return pos - size;
+}
+
+/* レコードを書き込み (end から)
+ *
+ * データは、削除した2つの範囲と挿入したバイト列を続けて書き込む */
+
+static void _put_rec(TextUndo *p,const TextUndoRec *rec,
+	const char *del1,int len1,const char *del2,int len2,const char *ins)
+{
+	uint8_t *pd;
+	int size;
+
+	size = _REC_SIZE(rec->del_len + rec->ins_len);
+
+	pd = p->buf + p->end;
+
+	memcpy(pd, rec, sizeof(TextUndoRec));
+	pd += sizeof(TextUndoRec);
+
+	if(len1) memcpy(pd, del1, len1);
+	if(len2) memcpy(pd + len1, del2, len2);
+	if(rec->ins_len) memcpy(pd + len1 + len2, ins, rec->ins_len);
+
+	memcpy(p->buf + p->end + size - sizeof(int), &size, sizeof(int));
+
+	p->end += size;
+}
+
+/* 最も古いアンドゥ単位を削除
+ *
+ * keep_last: 0 以外で、最後の単位 (記録中) は削除しない
+ * return: 0 で成功、-1 で削除できない */
+
+static int _evict_step(TextUndo *p,int keep_last)
+{
+	TextUndoRec rec;
+	int pos = p->top;
+
+	do
+	{
+		_get_rec(p, pos, &rec);
+
+		pos += _REC_SIZE(rec.del_len + rec.ins_len);
+
+		if(pos == p->end) break;
+
+		_get_rec(p, pos, &rec);
+	} while(!rec.step);
+
+	if(pos == p->end && keep_last) return -1;
+
+	p->top = pos;
+
+	if(p->cur < p->top) p->cur = p->top;
+
+	if(p->top == p->end)
+		p->top = p->cur = p->end = 0;
+
+	return 0;
+}
+
+/* 終端に size バイトの空きを作る
+ *
+ * evict: 0 以外で、足りなければ古い単位を削除する。
+ *  新しい単位を開始しない場合、記録中の単位は削除しない。
+ * return: 0 で成功 */
+
+static int _make_room(TextUndo *p,int size,int evict)
+{
+	uint8_t *buf;
+	int n;
+
+	if(size > p->cap) return -1;
+
+	//上限を超える分は古いものから削除
+
+	while(p->end - p->top + size > p->cap)
+	{
+		if(!evict || _evict_step(p, !p->new_step)) return -1;
+	}
+
+	//先頭へ詰める
+
+	if(p->end + size > p->cap)
+	{
+		memmove(p->buf, p->buf + p->top, p->end - p->top);
+
+		p->cur -= p->top;
+		p->end -= p->top;
+		p->top = 0;
+	}
+
+	//確保
+
+	if(p->end + size > p->alloc)
+	{
+		n = (p->alloc)? p->alloc: 4096;
+
+		while(n < p->end + size)
+			n *= 2;
+
+		if(n > p->cap) n = p->cap;
+
+		buf = (uint8_t *)realloc(p->buf, n);
+		if(!buf) return -1;
+
+		p->buf = buf;
+		p->alloc = n;
+	}
+
+	return 0;
+}
+
+/* 編集を記録
+ *
+ * 同じ単位内で、直前の挿入に続けて挿入した場合は、1つのレコードにまとめる */
+
+static void _add(TextUndo *p,int pos,const char *del1,int len1,const char *del2,int len2,
+	const char *ins,int ins_len)
+{
+	TextUndoRec rec;
+	int last,size;
+
+	if(len1 + len2 + ins_len == 0 || p->skip) return;
+
+	//リドゥの分は削除
+
+	p->end = p->cur;
+
+	//直前の挿入の続き
+
+	if(!p->new_step && !len1 && !len2 && p->cur > p->top)
+	{
+		last = _get_prev(p, p->cur);
+		_get_rec(p, last, &rec);
+
+		if(rec.del_len == 0 && pos == rec.pos + rec.ins_len)
+		{
+			size = _REC_SIZE(rec.ins_len + ins_len) - _REC_SIZE(rec.ins_len);
+
+			if(_make_room(p, size, 0) == 0)
+			{
+				//_make_room() で詰められた場合があるので、取得し直す
+
+				last = _get_prev(p, p->end);
+
+				memcpy(p->buf + last + sizeof(TextUndoRec) + rec.ins_len, ins, ins_len);
+
+				rec.ins_len += ins_len;
+				memcpy(p->buf + last, &rec, sizeof(TextUndoRec));
+
+				size = _REC_SIZE(rec.ins_len);
+				memcpy(p->buf + last + size - sizeof(int), &size, sizeof(int));
+
+				p->end = p->cur = last + size;
+				return;
+			}
+		}
+	}
+
+	//新しいレコード
+	//(記録できない場合、それより前の履歴は戻せなくなるので、すべて削除。
+	// 単位の途中から記録すると一部だけ戻ることになるので、単位の残りも記録しない)
+
+	if(_make_room(p, _REC_SIZE(len1 + len2 + ins_len), 1))
+	{
+		TextUndo_clear(p);
+		p->skip = 1;
+		return;
+	}
+
+	rec.pos = pos;
+	rec.del_len = len1 + len2;
+	rec.ins_len = ins_len;
+	rec.step = (p->new_step || p->cur == p->top);
+
+	_put_rec(p, &rec, del1, len1, del2, len2, ins);
+
+	p->cur = p->end;
+	p->new_step = 0;
+}
+
+
+//=====================
+
+
+/* 作成
+ *
+ * cap: 履歴の最大サイズ (バイト) */
+
+TextUndo *TextUndo_new(int cap)
+{
+	TextUndo *p;
+
+	p = (TextUndo *)calloc(1, sizeof(TextUndo));
+	if(!p) return NULL;
+
+	p->cap = cap;
+	p->new_step = 1;
+
+	return p;
+}
+
+/* 削除 */
+
+void TextUndo_destroy(TextUndo *p)
+{
+	if(p)
+	{
+		free(p->buf);
+		free(p);
+	}
+}
+
+/* 履歴をすべて削除 (バッファは残す) */
+
+void TextUndo_clear(TextUndo *p)
+{
+	p->top = p->cur = p->end = 0;
+	p->new_step = 1;
+	p->skip = 0;
+}
+
+/* 次の編集から、新しいアンドゥ単位にする */
+
+void TextUndo_begin(TextUndo *p)
+{
+	p->new_step = 1;
+	p->skip = 0;
+}
+
+/* カーソル位置に挿入して記録 */
+
+int TextUndo_insert(TextUndo *p,TextBuf *tb,const char *text,int len)
+{
+	int pos = tb->gap_top;
+
+	if(TextBuf_insert(tb, text, len)) return -1;
+
+	_add(p, pos, NULL, 0, NULL, 0, text, len);
+
+	return 0;
+}
+
+/* カーソルの直前に挿入済みのテキストを記録
+ *
+ * TextBuf_readFd() などで直接挿入した場合 */
+
+void TextUndo_addInserted(TextUndo *p,TextBuf *tb,int len)
+{
+	_add(p, tb->gap_top - len, NULL, 0, NULL, 0, tb->buf + tb->gap_top - len, len);
+}
+
+/* カーソルの前後を削除して記録 */
+
+void TextUndo_deleteSurrounding(TextUndo *p,TextBuf *tb,int before,int after)
+{
+	if(before > tb->gap_top)
+		before = tb->gap_top;
+
+	if(after > tb->size - tb->gap_end)
+		after = tb->size - tb->gap_end;
+
+	//削除される範囲はギャップの前後に分かれている
+
+	_add(p, tb->gap_top - before,
+		tb->buf + tb->gap_top - before, before,
+		tb->buf + tb->gap_end, after, NULL, 0);
+
+	TextBuf_deleteSurrounding(tb, before, after);
+}
+
+/* アンドゥ
+ *
+ * 1単位分を、レコードの逆順に戻す。
+ * カーソルは戻したテキストの後ろへ移動する。
+ * return: 0 で成功、-1 で履歴なし */
+
+int TextUndo_undo(TextUndo *p,TextBuf *tb)
+{
+	TextUndoRec rec;
+	int pos;
+
+	if(p->cur == p->top) return -1;
+
+	do
+	{
+		pos = _get_prev(p, p->cur);
+		_get_rec(p, pos, &rec);
+
+		//挿入したテキストを、削除したテキストに置き換える
+
+		TextBuf_moveCursor(tb, rec.pos);
+		TextBuf_deleteSurrounding(tb, 0, rec.ins_len);
+		TextBuf_insert(tb, (char *)p->buf + pos + sizeof(TextUndoRec), rec.del_len);
+
+		p->cur = pos;
+	} while(!rec.step && p->cur > p->top);
+
+	p->new_step = 1;
+
+	return 0;
+}
+
+/* リドゥ
+ *
+ * return: 0 で成功、-1 で履歴なし */
+
+int TextUndo_redo(TextUndo *p,TextBuf *tb)
+{
+	TextUndoRec rec;
+
+	if(p->cur == p->end) return -1;
+
+	do
+	{
+		_get_rec(p, p->cur, &rec);
+
+		TextBuf_moveCursor(tb, rec.pos);
+		TextBuf_deleteSurrounding(tb, 0, rec.del_len);
+		TextBuf_insert(tb, (char *)p->buf + p->cur + sizeof(TextUndoRec) + rec.del_len, rec.ins_len);
+
+		p->cur += _REC_SIZE(rec.del_len + rec.ins_len);
+
+		if(p->cur == p->end) break;
+
+		_get_rec(p, p->cur, &rec);
+	} while(!rec.step);
+
+	p->new_step = 1;
+
+	return 0;
+}
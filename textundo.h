@@ -0,0 +1,47 @@
+#ifndef _TEXTUNDO_H_
+#define _TEXTUNDO_H_
+
+/* TextBuf のアンドゥ履歴
+ *
+ * 編集ごとに、位置と削除/挿入したバイト列だけをレコードとして追記する。
+ * TextUndo_begin() から次の TextUndo_begin() までの編集が、1回のアンドゥ単位。
+ * 上限サイズを超える場合は、古い単位から削除する。
+ * 記録中の単位を削除する必要がある場合は、履歴をすべて削除し、その単位は記録しない。
+ *
+ * レコード: [TextUndoRec][削除したバイト列][挿入したバイト列][パディング][int サイズ] */
+
+typedef struct _TextUndo TextUndo;
+
+typedef struct
+{
+	int pos,		//編集位置 (バイト)
+		del_len,	//削除したバイト数
+		ins_len,	//挿入したバイト数
+		step;		//0 以外でアンドゥ単位の先頭
+}TextUndoRec;
+
+struct _TextUndo
+{
+	uint8_t *buf;
+	int cap,		//最大サイズ
+		alloc,		//確保済みのサイズ
+		top,		//最も古いレコードの位置
+		cur,		//現在の位置 (前がアンドゥ、後ろがリドゥ)
+		end,		//終端
+		new_step,	//次の記録で新しい単位を開始する
+		skip;		//記録中の単位が記録できなくなったので、次の単位まで記録しない
+};
+
+TextUndo *TextUndo_new(int cap);
+void TextUndo_destroy(TextUndo *p);
+void TextUndo_clear(TextUndo *p);
+void TextUndo_begin(TextUndo *p);
+
+int TextUndo_insert(TextUndo *p,TextBuf *tb,const char *text,int len);
+void TextUndo_addInserted(TextUndo *p,TextBuf *tb,int len);
+void TextUndo_deleteSurrounding(TextUndo *p,TextBuf *tb,int before,int after);
+
+int TextUndo_undo(TextUndo *p,TextBuf *tb);
+int TextUndo_redo(TextUndo *p,TextBuf *tb);
+
+#endif
@@ -0,0 +1,310 @@
+/******************************
+ * タイル分割の並列描画
+ ******************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <wayland-client.h>
+
+#include "imagebuf.h"
+#include "drawlist.h"
+#include "tilerender.h"
+
+
+/* 1タイルを描画 */
+
+static void _render_tile(TileRender *p,int no)
+{
+	int x,y,w,h;
+
+	x = (no % p->tile_xnum) * TILERENDER_TILE_W;
+	y = (no / p->tile_xnum) * TILERENDER_TILE_H;
+
+	w = p->w - x;
+	h = p->h - y;
+
+	if(w > TILERENDER_TILE_W) w = TILERENDER_TILE_W;
+	if(h > TILERENDER_TILE_H) h = TILERENDER_TILE_H;
+
+	DrawList_render(p->list, p->img, p->x + x, p->y + y, w, h);
+}
+
+/* キューの先頭から取り出す
+ * return: タイル番号 (-1 で空) */
+
+static int _queue_pop(TileQueue *q)
+{
+	int no = -1;
+
+	pthread_mutex_lock(&q->mutex);
+
+	if(q->top < q->end)
+		no = q->top++;
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return no;
+}
+
+/* キューの末尾から奪う */
+
+static int _queue_steal(TileQueue *q)
+{
+	int no = -1;
+
+	pthread_mutex_lock(&q->mutex);
+
+	if(q->top < q->end)
+		no = --q->end;
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return no;
+}
+
+/* タイルがなくなるまで処理する
+ *
+ * index: 自分のキューの番号 */
+
+static void _work(TileRender *p,int index)
+{
+	int i,no,cnt = 0;
+
+	while(1)
+	{
+		no = _queue_pop(p->queues + index);
+
+		//他のスレッドから奪う
+
+		for(i = 1; no < 0 && i < p->thread_num; i++)
+			no = _queue_steal(p->queues + (index + i) % p->thread_num);
+
+		if(no < 0) break;
+
+		_render_tile(p, no);
+		cnt++;
+	}
+
+	//処理数を加算
+
+	pthread_mutex_lock(&p->mutex);
+
+	p->done += cnt;
+
+	if(cnt && p->done == p->tile_num)
+		pthread_cond_signal(&p->cond_done);
+
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/* ワーカースレッド */
+
+static void *_thread_worker(void *arg)
+{
+	TileQueue *q = (TileQueue *)arg;
+	TileRender *p = q->owner;
+	uint32_t frame;
+	int index;
+
+	index = q - p->queues;
+
+	pthread_mutex_lock(&p->mutex);
+	frame = p->frame;
+
+	while(1)
+	{
+		while(!p->quit && frame == p->frame)
+			pthread_cond_wait(&p->cond_start, &p->mutex);
+
+		if(p->quit) break;
+
+		frame = p->frame;
+
+		pthread_mutex_unlock(&p->mutex);
+
+		_work(p, index);
+
+		pthread_mutex_lock(&p->mutex);
+	}
+
+	pthread_mutex_unlock(&p->mutex);
+
+	return NULL;
+}
+
+
+//=====================
+
+
+/* 作成
+ *
+ * thread_num: 呼び出し元を含むスレッド数。0 以下で CPU 数。
+ *  1 の場合はスレッドを作成せず、呼び出し元で順に描画する。 */
+
+TileRender *TileRender_new(int thread_num)
+{
+	TileRender *p;
+	int i;
+
+	if(thread_num <= 0)
+	{
+		thread_num = sysconf(_SC_NPROCESSORS_ONLN);
+		if(thread_num <= 0) thread_num = 1;
+	}
+
+	p = (TileRender *)calloc(1, sizeof(TileRender));
+	if(!p) return NULL;
+
+	p->threads = (pthread_t *)calloc(thread_num, sizeof(pthread_t));
+	p->queues = (TileQueue *)calloc(thread_num, sizeof(TileQueue));
+
+	if(!p->threads || !p->queues)
+	{
+		free(p->threads);
+		free(p->queues);
+		free(p);
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond_start, NULL);
+	pthread_cond_init(&p->cond_done, NULL);
+
+	for(i = 0; i < thread_num; i++)
+	{
+		p->queues[i].owner = p;
+		pthread_mutex_init(&p->queues[i].mutex, NULL);
+	}
+
+	//ワーカー ([0] は呼び出し元)
+	//作成できなかった場合は、作成できた数で処理する
+
+	p->thread_num = 1;
+
+	for(i = 1; i < thread_num; i++)
+	{
+		if(pthread_create(p->threads + i, NULL, _thread_worker, p->queues + i))
+			break;
+
+		p->thread_num++;
+	}
+
+	//使わないキュー
+
+	for(; i < thread_num; i++)
+		pthread_mutex_destroy(&p->queues[i].mutex);
+
+	return p;
+}
+
+/* 削除 */
+
+void TileRender_destroy(TileRender *p)
+{
+	int i;
+
+	if(!p) return;
+
+	pthread_mutex_lock(&p->mutex);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond_start);
+	pthread_mutex_unlock(&p->mutex);
+
+	for(i = 1; i < p->thread_num; i++)
+		pthread_join(p->threads[i], NULL);
+
+	for(i = 0; i < p->thread_num; i++)
+		pthread_mutex_destroy(&p->queues[i].mutex);
+
+	pthread_mutex_destroy(&p->mutex);
+	pthread_cond_destroy(&p->cond_start);
+	pthread_cond_destroy(&p->cond_done);
+
+	free(p->threads);
+	free(p->queues);
+	free(p);
+}
+
+/* 範囲を描画
+ *
+ * 範囲をタイルに分割して、全スレッドで描画する。
+ * タイルごとに DrawList を範囲内で実行するので、
+ * 結果は DrawList_render() で一度に描画した場合と同じ。
+ * すべてのタイルが終わるまで戻らない。 */
+
+void TileRender_run(TileRender *p,DrawList *list,ImageBuf *img,int x,int y,int w,int h)
+{
+	int i,num,xnum;
+
+	//イメージ内に収める
+
+	if(x < 0) { w += x; x = 0; }
+	if(y < 0) { h += y; y = 0; }
+	if(x + w > img->width) w = img->width - x;
+	if(y + h > img->height) h = img->height - y;
+
+	if(w <= 0 || h <= 0) return;
+
+	xnum = (w + TILERENDER_TILE_W - 1) / TILERENDER_TILE_W;
+	num = xnum * ((h + TILERENDER_TILE_H - 1) / TILERENDER_TILE_H);
+
+	//1タイルまたは1スレッドの場合は直接描画
+
+	if(num == 1 || p->thread_num == 1)
+	{
+		DrawList_render(list, img, x, y, w, h);
+		return;
+	}
+
+	//準備
+
+	pthread_mutex_lock(&p->mutex);
+
+	p->list = list;
+	p->img = img;
+	p->x = x;
+	p->y = y;
+	p->w = w;
+	p->h = h;
+	p->tile_xnum = xnum;
+	p->tile_num = num;
+	p->done = 0;
+
+	pthread_mutex_unlock(&p->mutex);
+
+	//タイルを連続した範囲で各キューに割り当てる
+
+	for(i = 0; i < p->thread_num; i++)
+	{
+		pthread_mutex_lock(&p->queues[i].mutex);
+
+		p->queues[i].top = num * i / p->thread_num;
+		p->queues[i].end = num * (i + 1) / p->thread_num;
+
+		pthread_mutex_unlock(&p->queues[i].mutex);
+	}
+
+	//開始
+
+	pthread_mutex_lock(&p->mutex);
+	p->frame++;
+	pthread_cond_broadcast(&p->cond_start);
+	pthread_mutex_unlock(&p->mutex);
+
+	//呼び出し元も処理する
+
+	_work(p, 0);
+
+	//終了を待つ
+
+	pthread_mutex_lock(&p->mutex);
+
+	while(p->done < p->tile_num)
+		pthread_cond_wait(&p->cond_done, &p->mutex);
+
+	pthread_mutex_unlock(&p->mutex);
+}
@@ -0,0 +1,51 @@
+#ifndef _TILERENDER_H_
+#define _TILERENDER_H_
+
+/* タイル分割の並列描画
+ *
+ * 描画範囲をキャッシュに収まるサイズのタイルに分割して、
+ * 固定数のワーカースレッドで DrawList を実行する。
+ * 各スレッドは自分のキューのタイルを先頭から処理し、
+ * 空になったら他のスレッドのキューの末尾から奪う。 */
+
+typedef struct _TileRender TileRender;
+
+typedef struct
+{
+	TileRender *owner;
+	pthread_mutex_t mutex;
+	int top,	//次に処理するタイル
+		end;	//終端 (含まない)
+}TileQueue;
+
+struct _TileRender
+{
+	pthread_t *threads;
+	TileQueue *queues;	//スレッドごと ([0] は呼び出し元)
+	int thread_num;		//呼び出し元を含むスレッド数
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_start,
+		cond_done;
+	uint32_t frame;		//開始ごとに +1
+	int quit,
+		done;			//処理済みのタイル数
+
+	//実行中の描画
+	DrawList *list;
+	ImageBuf *img;
+	int x,y,
+		w,h,
+		tile_xnum,		//横方向のタイル数
+		tile_num;
+};
+
+//1タイルのサイズ (32bit で 32KB)
+#define TILERENDER_TILE_W  256
+#define TILERENDER_TILE_H  32
+
+TileRender *TileRender_new(int thread_num);
+void TileRender_destroy(TileRender *p);
+void TileRender_run(TileRender *p,DrawList *list,ImageBuf *img,int x,int y,int w,int h);
+
+#endif